@@ -29,48 +29,107 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
+    size_t entryIndex;
 
-    size_t numBytesCounted = 0;
-    //Starting point at buffer->out_offs
-    int entryOffset = buffer->out_offs;
-    int numEntriesChecked = 0; //Want to stop if all entries have been checked (since char_offset is if concatenated end to end, doesn't loop)
+    if (aesd_circular_buffer_find_index_for_fpos(buffer, char_offset, &entryIndex, entry_offset_byte_rtn) != 0) {
+        return NULL;
+    }
+    return aesd_circular_buffer_entry_at(buffer, entryIndex);
+}
 
+/**
+ * Like aesd_circular_buffer_find_entry_offset_for_fpos(), but gives the entry as an index counted from
+ * the oldest one, which stays valid as entries are added until buffer->generation changes.
+ * @param entry_index_rtn set to the index of the entry holding char_offset
+ * @param entry_offset_byte_rtn set to the byte within that entry
+ * @return 0 on success, -1 if this position is not available in the buffer
+ */
+int aesd_circular_buffer_find_index_for_fpos(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_index_rtn, size_t *entry_offset_byte_rtn)
+{
+    size_t count = aesd_circular_buffer_count(buffer);
+    if (count == 0 || char_offset >= buffer->size) {
+        return -1;
+    }
 
-    //Refernce: Copilot AI debugging (was originally checking 'numBytesCounted < char_offset',
-    //but that assumed the buffer was full)
-    while (numEntriesChecked < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+    //start_offs is relative to the oldest entry, so entries are sorted by it and a binary search
+    //for the last entry starting at or before char_offset replaces walking and summing sizes
+    size_t baseOffs = buffer->entry[buffer->out_offs].start_offs;
+    size_t low = 0;
+    size_t high = count - 1;
+    while (low < high) {
+        size_t mid = low + (high - low + 1) / 2;
+        if (aesd_circular_buffer_entry_at(buffer, mid)->start_offs - baseOffs <= char_offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
 
-        size_t entrySize = buffer->entry[entryOffset].size;
+    *entry_index_rtn = low;
+    *entry_offset_byte_rtn = char_offset - (aesd_circular_buffer_entry_at(buffer, low)->start_offs - baseOffs);
+    return 0;
+}
 
-        if (numBytesCounted + entrySize > char_offset) {
-            *entry_offset_byte_rtn = char_offset - numBytesCounted;
-            return &buffer->entry[entryOffset];
-        }
+/**
+ * @param buffer the buffer to search.  Any necessary locking must be performed by caller.
+ * @param entry_index the zero referenced entry, counting from the oldest one stored
+ * @param entry_offset the zero referenced byte within that entry
+ * @param char_offset_rtn is set to the position of that byte if all buffer strings were concatenated end to end
+ * @return 0 on success, -1 if the entry or the byte within it is not in the buffer
+ */
+int aesd_circular_buffer_fpos_for_entry(struct aesd_circular_buffer *buffer,
+            size_t entry_index, size_t entry_offset, size_t *char_offset_rtn)
+{
+    if (entry_index >= aesd_circular_buffer_count(buffer)) {
+        return -1;
+    }
 
-        numBytesCounted += entrySize;
-        numEntriesChecked++;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, entry_index);
+    if (entry_offset >= entry->size) {
+        return -1;
+    }
 
-        entryOffset++; //Incrementing for next entry to be read
-        if (entryOffset == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-            entryOffset = 0;
-        }
+    *char_offset_rtn = entry->start_offs - buffer->entry[buffer->out_offs].start_offs + entry_offset;
+    return 0;
+}
 
-        //Stop if reached end of non-full buffer. Reference: Copilot AI debugging
-        if (!buffer->full && entryOffset == buffer->in_offs) {
-            break;
-        }
+/**
+* Drops the oldest entry of @param buffer to make room, counting it as an eviction and handing it to
+* buffer->evict if one is set.
+* @return the buffptr of the dropped entry
+*/
+static const char* evict_oldest(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *oldest = &buffer->entry[buffer->out_offs];
+    const char* retVal = oldest->buffptr;
+
+    buffer->generation++;
+    buffer->evicted_entries++;
+    buffer->evicted_bytes += oldest->size;
+    if (buffer->evict) {
+        buffer->evict(buffer, oldest);
     }
 
-    return NULL;
+    //Free slots never hold stale pointers, whoever frees the returned buffptr owns it alone
+    buffer->size -= oldest->size;
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+    buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+    buffer->count--;
+
+    return retVal;
 }
 
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
 * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
-* new start location.
+* new start location. When buffer->evict is set, oldest entries are also evicted while buffer->max_bytes
+* would be exceeded (an entry larger than max_bytes is then stored on its own), and every evicted entry
+* is passed to the callback instead of being returned.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
-* @return NULL or, if an existing entry at out_offs was replaced,
+* @return NULL or, if an existing entry at out_offs was replaced and no evict callback is set,
 * the value of buffptr for the entry which was replaced (for use with dynamic memory allocation/free)
 */
 const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
@@ -78,34 +137,152 @@ const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
     const char* retVal = NULL;
 
+    //New entry starts right after the newest one
+    size_t startOffs = 0;
+    if (buffer->count > 0) {
+        startOffs = buffer->entry[buffer->out_offs].start_offs + buffer->size;
+    }
+
     if (buffer->full) {
-        retVal = buffer->entry[buffer->in_offs].buffptr; //Should be the val of buffptr for the entry which will be replaced
-        buffer->out_offs++;
-        
+        retVal = evict_oldest(buffer); //Should be the val of buffptr for the entry which will be replaced
+        if (buffer->evict) {
+            retVal = NULL;
+        }
     }
-    if (buffer->out_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-        buffer->out_offs = 0;
+
+    //Byte budget, only enforced with a callback since several entries may go at once
+    while (buffer->evict && buffer->max_bytes && buffer->count > 0 &&
+            buffer->size + add_entry->size > buffer->max_bytes) {
+        evict_oldest(buffer);
     }
 
     buffer->entry[buffer->in_offs] = *add_entry;
-    buffer->in_offs++; //Points to next location to write new entry to
+    buffer->entry[buffer->in_offs].start_offs = startOffs;
+    buffer->entry[buffer->in_offs].seq = buffer->next_seq;
+    buffer->size += add_entry->size;
+    buffer->in_offs = (buffer->in_offs + 1) & buffer->mask; //Points to next location to write new entry to
+    buffer->count++;
+    buffer->next_seq++;
+
+    //Check if now full after adding entry
+    buffer->full = (buffer->count == buffer->capacity);
+
+    return retVal;
+}
+
+/**
+* Evicts the oldest entry of @param buffer, if any, through buffer->evict and counts it like any other
+* eviction. Used to make room when entries share storage managed by the caller.
+* Any necessary locking must be handled by the caller.
+*/
+void aesd_circular_buffer_evict_oldest(struct aesd_circular_buffer *buffer)
+{
+    if (buffer->count > 0) {
+        evict_oldest(buffer);
+    }
+}
 
-    if (buffer->in_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-        buffer->in_offs = 0;
+/**
+* Evicts the oldest entries of @param buffer until it fits buffer->max_bytes again, e.g. after the budget
+* was lowered. The newest entry is kept even if it alone is over budget. Does nothing without buffer->evict.
+* Any necessary locking must be handled by the caller.
+*/
+void aesd_circular_buffer_trim(struct aesd_circular_buffer *buffer)
+{
+    while (buffer->evict && buffer->max_bytes && buffer->count > 1 && buffer->size > buffer->max_bytes) {
+        evict_oldest(buffer);
     }
+    buffer->full = (buffer->count == buffer->capacity);
+}
 
-    //Check if now full after adding entry
-    if (buffer->in_offs == buffer->out_offs) {
-        buffer->full = true;
+/**
+* Removes the oldest entry of @param buffer, any necessary locking must be handled by the caller.
+* @return the buffptr of the removed entry for the caller to free, NULL if the buffer was empty
+*/
+const char* aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer)
+{
+    if (buffer->count == 0) {
+        return NULL;
     }
 
+    struct aesd_buffer_entry *oldest = &buffer->entry[buffer->out_offs];
+    const char* retVal = oldest->buffptr;
+
+    buffer->generation++;
+    buffer->size -= oldest->size;
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+    buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+    buffer->count--;
+    buffer->full = false;
+
     return retVal;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* @return the number of slots (a power of two) needed to hold @param capacity entries
+*/
+uint32_t aesd_circular_buffer_slots_for(uint32_t capacity)
+{
+    uint32_t slots = 1;
+    while (slots < capacity) {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+/**
+* Changes the capacity of @param buffer to @param new_capacity, moving the stored entries in order into
+* @param new_entry, an array of @param new_slots entries (a power of two, at least new_capacity) allocated
+* by the caller. Passing the current entry array with the current slot count only changes the capacity.
+* The caller must first remove entries (aesd_circular_buffer_remove_entry) until at most new_capacity remain.
+* Any necessary locking must be handled by the caller.
+* @return the previous entry array, for the caller to free unless it is new_entry or buffer->inline_entry,
+* or NULL if the arguments are invalid (the buffer is then unchanged)
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *new_entry, uint32_t new_slots, uint32_t new_capacity)
+{
+    struct aesd_buffer_entry *oldEntry = buffer->entry;
+
+    if (new_capacity == 0 || new_capacity > new_slots || (new_slots & (new_slots - 1)) != 0 ||
+            buffer->count > new_capacity) {
+        return NULL;
+    }
+
+    if (new_entry == oldEntry) {
+        if (new_slots != buffer->mask + 1) {
+            return NULL;
+        }
+    } else {
+        if (new_entry == buffer->inline_entry && new_slots > AESD_CIRCULAR_BUFFER_INLINE_SLOTS) {
+            return NULL;
+        }
+        //Compact the entries to the start of the new array, oldest first. Different arrays never overlap.
+        memset(new_entry, 0, new_slots * sizeof(*new_entry));
+        for (uint32_t i = 0; i < buffer->count; i++) {
+            new_entry[i] = *aesd_circular_buffer_entry_at(buffer, i);
+        }
+        buffer->entry = new_entry;
+        buffer->mask = new_slots - 1;
+        buffer->generation++;
+        buffer->out_offs = 0;
+        buffer->in_offs = buffer->count & buffer->mask;
+    }
+
+    buffer->capacity = new_capacity;
+    buffer->full = (buffer->count == buffer->capacity);
+    return oldEntry;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct holding up to
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries in its inline slots
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->inline_entry;
+    buffer->mask = AESD_CIRCULAR_BUFFER_INLINE_SLOTS - 1;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 }
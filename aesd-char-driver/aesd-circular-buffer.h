@@ -16,7 +16,15 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default capacity, used by aesd_circular_buffer_init()
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Slots embedded in the buffer itself, the power of two holding the default capacity.
+ * Larger capacities use an entry array supplied through aesd_circular_buffer_resize().
+ */
+#define AESD_CIRCULAR_BUFFER_INLINE_SLOTS 16
 
 struct aesd_buffer_entry
 {
@@ -28,44 +36,150 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Running count of all bytes added to the buffer before this entry, set by
+     * aesd_circular_buffer_add_entry(). Only differences between entries are used, so wrapping is harmless.
+     */
+    size_t start_offs;
+    /**
+     * Sequence number stamped by aesd_circular_buffer_add_entry(), one more than the entry added before it.
+     * Unlike the entry's index it does not change when older entries are evicted.
+     */
+    uint64_t seq;
 };
 
+struct aesd_circular_buffer;
+
+/**
+ * Called for each entry dropped to make room for a new one, before its slot is reused
+ */
+typedef void (*aesd_circular_buffer_evict_fn)(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry);
+
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations,
+     * mask + 1 slots long. Points at inline_entry unless the buffer was resized.
+     */
+    struct aesd_buffer_entry *entry;
+    struct aesd_buffer_entry inline_entry[AESD_CIRCULAR_BUFFER_INLINE_SLOTS];
+    /**
+     * Number of slots minus one, slots are a power of two so indexes wrap with "& mask"
+     */
+    uint32_t mask;
+    /**
+     * Maximum number of entries stored before the oldest is overwritten, at most mask + 1
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t capacity;
+    /**
+     * Number of entries currently stored
+     */
+    uint32_t count;
     /**
      * The current location in the entry structure where the next write should
-     * be stored.
+     * be stored. Equals out_offs when full only if capacity uses every slot, test full or count instead.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
-     * set to true when the buffer entry structure is full
+     * set to true when the buffer entry structure is full (count == capacity)
      */
     bool full;
+    /**
+     * Total number of bytes in all entries currently stored, i.e. the SEEK_END position
+     */
+    size_t size;
+    /**
+     * Optional byte budget, 0 for none. Only enforced when evict is set.
+     */
+    size_t max_bytes;
+    /**
+     * Optional eviction callback, when set it receives every evicted entry instead of add_entry returning it
+     */
+    aesd_circular_buffer_evict_fn evict;
+    /**
+     * Bumped whenever entries leave the front or move to other slots, i.e. whenever a saved entry
+     * index may stop pointing at the same entry
+     */
+    unsigned long generation;
+    /**
+     * Entries and bytes evicted by add_entry since init, by count or by byte budget
+     */
+    uint64_t evicted_entries;
+    uint64_t evicted_bytes;
+    /**
+     * Number of entries added since init, i.e. the sequence number the next entry gets
+     */
+    uint64_t next_seq;
 };
 
+extern int aesd_circular_buffer_find_index_for_fpos(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_index_rtn, size_t *entry_offset_byte_rtn);
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
 extern const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern int aesd_circular_buffer_fpos_for_entry(struct aesd_circular_buffer *buffer,
+            size_t entry_index, size_t entry_offset, size_t *char_offset_rtn);
+
+extern void aesd_circular_buffer_evict_oldest(struct aesd_circular_buffer *buffer);
+
+extern void aesd_circular_buffer_trim(struct aesd_circular_buffer *buffer);
+
+extern const char* aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer);
+
+extern uint32_t aesd_circular_buffer_slots_for(uint32_t capacity);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *new_entry, uint32_t new_slots, uint32_t new_capacity);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 /**
- * Create a for loop to iterate over each member of the circular buffer.
+ * @return the number of entries currently stored in @param buffer
+ */
+static inline size_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->count;
+}
+
+/**
+ * @return the entry @param index places after the oldest one in @param buffer, index must be below count
+ */
+static inline struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer, size_t index)
+{
+    return &buffer->entry[(buffer->out_offs + index) & buffer->mask];
+}
+
+/**
+ * @return the sequence number of the oldest entry of @param buffer, next_seq if it is empty.
+ * Entries leave oldest first, so the entry at index i has sequence number oldest + i.
+ */
+static inline uint64_t aesd_circular_buffer_oldest_seq(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->next_seq - buffer->count;
+}
+
+//@return the sequence number of the entry at @param index (0 = oldest) of @param buffer
+static inline uint64_t aesd_circular_buffer_seq_at(struct aesd_circular_buffer *buffer, size_t index)
+{
+    return aesd_circular_buffer_entry_at(buffer, index)->seq;
+}
+
+/**
+ * Create a for loop to iterate over each entry stored in the circular buffer, oldest first.
+ * Free slots are skipped, evicted and removed entries were already handed back to the caller.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -73,9 +187,9 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  * }
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
-    for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
-            index++, entryptr=&((buffer)->entry[index]))
+    for(index=0, entryptr=aesd_circular_buffer_entry_at(buffer, index); \
+            index<(buffer)->count; \
+            index++, entryptr=aesd_circular_buffer_entry_at(buffer, index))
 
 
 
@@ -0,0 +1,144 @@
+/**
+ * @file aesd-trace.h
+ * @brief Tracepoints of the AESD char driver, under events/aesdchar/ in tracefs
+ *
+ * Disabled tracepoints are a patched out jump, so they stay in the fast paths. main.c defines
+ * CREATE_TRACE_POINTS before including this header to emit them.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(aesd_io,
+
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t result),
+
+    TP_ARGS(minor, pos, count, result),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, result)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->result = result;
+    ),
+
+    TP_printk("minor=%u pos=%lld count=%zu result=%zd",
+        __entry->minor, __entry->pos, __entry->count, __entry->result)
+);
+
+//A read() or readv(), pos is where it started
+DEFINE_EVENT(aesd_io, aesd_read,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t result),
+    TP_ARGS(minor, pos, count, result)
+);
+
+//A write() or writev(), stored commands show up as aesd_commit
+DEFINE_EVENT(aesd_io, aesd_write,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t result),
+    TP_ARGS(minor, pos, count, result)
+);
+
+//A command completed by '\n' and stored in the circular buffer
+TRACE_EVENT(aesd_commit,
+
+    TP_PROTO(unsigned int minor, uint64_t seq, size_t size),
+
+    TP_ARGS(minor, seq, size),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(uint64_t, seq)
+        __field(size_t, size)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->seq = seq;
+        __entry->size = size;
+    ),
+
+    TP_printk("minor=%u seq=%llu size=%zu",
+        __entry->minor, (unsigned long long)__entry->seq, __entry->size)
+);
+
+//A command dropped to make room, by count, byte budget or byte ring space
+TRACE_EVENT(aesd_evict,
+
+    TP_PROTO(uint64_t seq, size_t size),
+
+    TP_ARGS(seq, size),
+
+    TP_STRUCT__entry(
+        __field(uint64_t, seq)
+        __field(size_t, size)
+    ),
+
+    TP_fast_assign(
+        __entry->seq = seq;
+        __entry->size = size;
+    ),
+
+    TP_printk("seq=%llu size=%zu", (unsigned long long)__entry->seq, __entry->size)
+);
+
+TRACE_EVENT(aesd_ioctl,
+
+    TP_PROTO(unsigned int minor, unsigned int cmd, long result),
+
+    TP_ARGS(minor, cmd, result),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(unsigned int, cmd)
+        __field(long, result)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->cmd = cmd;
+        __entry->result = result;
+    ),
+
+    TP_printk("minor=%u cmd=%#x nr=%u result=%ld",
+        __entry->minor, __entry->cmd, _IOC_NR(__entry->cmd), __entry->result)
+);
+
+//buffMutex was already held when a writer, ioctl or open wanted it
+TRACE_EVENT(aesd_lock_contended,
+
+    TP_PROTO(unsigned int minor),
+
+    TP_ARGS(minor),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+    ),
+
+    TP_printk("minor=%u", __entry->minor)
+);
+
+#endif /* AESD_TRACE_H */
+
+//Out of tree: the Makefile adds this directory to the include path of main.o
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesd-trace
+#include <trace/define_trace.h>
@@ -33,14 +33,154 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Size and sequence number of one command returned by AESDCHAR_IOCREADENTRIES
+ */
+struct aesd_entry_info {
+    /**
+     * Number of the command among all commands written since the module was loaded, never reused
+     */
+    uint64_t seq;
+    uint64_t size;
+};
+
+/**
+ * Passed to AESDCHAR_IOCREADENTRIES to fetch whole commands in one call
+ */
+struct aesd_read_entries {
+    /**
+     * The zero referenced command to start at, as for AESDCHAR_IOCSEEKTO
+     */
+    uint32_t write_cmd;
+    /**
+     * Upper limit for the number of commands returned
+     */
+    uint32_t max_entries;
+    /**
+     * User buffer of data_size bytes the commands are copied to back to back
+     */
+    uint64_t data;
+    uint64_t data_size;
+    /**
+     * User array of max_entries struct aesd_entry_info filled in for each command returned, or 0
+     */
+    uint64_t info;
+    /**
+     * Set by the driver: commands and bytes returned. If not even the first command fits data_size the
+     * ioctl fails with EMSGSIZE and bytes is the size it needs.
+     */
+    uint32_t num_entries;
+    uint32_t reserved;
+    uint64_t bytes;
+};
+
+/**
+ * Returned by AESDCHAR_IOCGETSEQRANGE. The stored commands are oldest .. next - 1, none if oldest == next.
+ * A client that last saw command s has missed some (they were evicted) if oldest > s + 1.
+ */
+struct aesd_seq_range {
+    uint64_t oldest;
+    uint64_t next;
+};
+
+/**
+ * Filled in by AESDCHAR_IOCGETINFO, all from one consistent state of the device
+ */
+struct aesd_info {
+    /**
+     * Commands stored and the most that are kept
+     */
+    uint32_t count;
+    uint32_t capacity;
+    /**
+     * Bytes stored, i.e. the SEEK_END position, and the byte budget (0 for none)
+     */
+    uint64_t bytes;
+    uint64_t max_bytes;
+    /**
+     * Sequence numbers of the oldest stored command and of the next one, as in struct aesd_seq_range
+     */
+    uint64_t oldest_seq;
+    uint64_t next_seq;
+    uint64_t evicted_entries;
+    uint64_t evicted_bytes;
+    /**
+     * Set by the caller: user array of max_sizes uint64_t that receives the size of each command, oldest
+     * first, or 0 to skip them
+     */
+    uint64_t sizes;
+    uint32_t max_sizes;
+    /**
+     * Set by the driver: number of sizes written, min(count, max_sizes)
+     */
+    uint32_t num_sizes;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Set how many write commands the device keeps (1 .. AESDCHAR_MAX_BUFFER_ENTRIES), oldest ones are dropped if needed
+#define AESDCHAR_IOCSETCAPACITY _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Set the byte budget of the device, 0 for none. Oldest commands are evicted to stay within it.
+#define AESDCHAR_IOCSETMAXBYTES _IOW(AESD_IOC_MAGIC, 3, uint64_t)
+// Copy up to max_entries whole commands, with their sizes and sequence numbers, starting at write_cmd
+#define AESDCHAR_IOCREADENTRIES _IOWR(AESD_IOC_MAGIC, 4, struct aesd_read_entries)
+// Seek to the start of the command with this sequence number, or to the end for the next one. ERANGE if it was evicted.
+#define AESDCHAR_IOCSEEKSEQ _IOW(AESD_IOC_MAGIC, 5, uint64_t)
+// Get the sequence numbers of the oldest stored command and of the next one to be written
+#define AESDCHAR_IOCGETSEQRANGE _IOR(AESD_IOC_MAGIC, 6, struct aesd_seq_range)
+// Get counts, sizes, sequence numbers and eviction counters of the device in one call
+#define AESDCHAR_IOCGETINFO _IOWR(AESD_IOC_MAGIC, 7, struct aesd_info)
+// Put this open file in consume mode (1) or back (0): each read removes the oldest whole commands that fit,
+// so readers sharing a device never get the same command. EMSGSIZE if the oldest does not fit the read.
+#define AESDCHAR_IOCCONSUME _IOW(AESD_IOC_MAGIC, 8, uint32_t)
+// Pin the commands stored right now to this open file and rewind it: reads (outside consume mode), seeks and
+// AESDCHAR_IOCSEEKTO/SEEKSEQ then use them, unaffected by later writes, until AESDCHAR_IOCDROPSNAPSHOT or close.
+// Returns the sequence numbers of the commands pinned.
+#define AESDCHAR_IOCSNAPSHOT _IOR(AESD_IOC_MAGIC, 9, struct aesd_seq_range)
+// Release the snapshot of this open file, reads follow the device again from the unchanged file position
+#define AESDCHAR_IOCDROPSNAPSHOT _IO(AESD_IOC_MAGIC, 10)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 10
+
+/**
+ * Start of the read-only mmap() of an aesdchar device. The mapping mirrors the newest stored commands
+ * ("records", numbered by command sequence number as in struct aesd_entry_info): record r is described by
+ * records[r % record_slots] at records_offset, and its bytes start at data ring position
+ * offset % data_bytes of the ring at data_offset, wrapping around its end.
+ * Records first_record .. next_record - 1 are valid. seq is odd while the driver updates the mapping,
+ * so copy what is needed between two reads of the same even seq.
+ */
+struct aesd_mmap_header {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t record_slots;
+    uint32_t reserved;
+    uint64_t records_offset;
+    uint64_t data_offset;
+    uint64_t data_bytes;
+    /**
+     * Data ring bytes written so far, where the next record's bytes start
+     */
+    uint64_t data_end;
+    uint64_t first_record;
+    uint64_t next_record;
+};
+
+struct aesd_mmap_record {
+    uint64_t offset;
+    uint64_t size;
+};
+
+#define AESDCHAR_MMAP_MAGIC 0x41455344 // "AESD"
+
+/**
+ * Upper limit for AESDCHAR_IOCSETCAPACITY and the buffer_entries module parameter
+ */
+#define AESDCHAR_MAX_BUFFER_ENTRIES (1U << 20)
 
 #endif /* AESD_IOCTL_H */
@@ -8,13 +8,22 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+#include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
+
+#define AESD_DEBUG 1  //Comment out this line to compile out debug messages
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
 #  ifdef __KERNEL__
-     /* This one if debugging is on, and kernel space */
-#    define PDEBUG(fmt, args...) printk( KERN_DEBUG "aesdchar: " fmt, ## args)
+     /* This one if debugging is on, and kernel space. Only prints while the debug parameter is set,
+        otherwise the static key leaves a patched out jump. */
+#    include <linux/jump_label.h>
+     DECLARE_STATIC_KEY_FALSE(aesd_debug_key);
+#    define PDEBUG(fmt, args...) do { \
+          if (static_branch_unlikely(&aesd_debug_key)) \
+               printk( KERN_DEBUG "aesdchar: " fmt, ## args); \
+     } while (0)
      #include <linux/mutex.h>
 #  else
      /* This one for user space */
@@ -24,19 +33,264 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/**
+ * One page of a command that is still being written (no '\n' yet)
+ */
+struct aesd_stage_chunk
+{
+     struct list_head list;
+     /**
+      * Staged bytes are data[head] .. data[used - 1], head advances as commands are stored
+      */
+     size_t head;
+     size_t used;
+     char data[];
+};
+
+#define AESD_STAGE_CHUNK_BYTES (PAGE_SIZE - sizeof(struct aesd_stage_chunk))
+
+/**
+ * Bytes written since the last completed command, kept as a list of aesd_stage_chunk
+ */
+struct aesd_stage
+{
+     struct list_head chunks;
+     size_t size;
+};
+
+/**
+ * Allocation behind each stored command, aesd_buffer_entry.buffptr points at data
+ */
+struct aesd_entry_data
+{
+     struct rcu_head rcu;
+     /**
+      * Bytes in data, fixed once stored. Lockless readers bound their copies by this rather than
+      * by aesd_buffer_entry.size, which they may see half updated.
+      */
+     size_t size;
+     /**
+      * 0 if data holds the size bytes as written, otherwise the length of the LZ4 compressed form in data
+      * (compress module parameter). size stays the logical length either way.
+      */
+     size_t packedSize;
+     /**
+      * Held by the circular buffer while the command is stored and by each snapshot pinning it
+      */
+     refcount_t refs;
+     char data[];
+};
+
+static inline struct aesd_entry_data *aesd_entry_data_of(const char *buffptr)
+{
+     return (struct aesd_entry_data *)(buffptr - offsetof(struct aesd_entry_data, data));
+}
+
+/**
+ * Optional contiguous storage for the bytes of all commands of a device (ring_bytes module parameter).
+ * A command never wraps: one that does not fit before the end starts over at offset 0. The bytes in use
+ * run from the oldest entry's buffptr to tail, so an entry's bytes are free again as soon as it is gone.
+ */
+struct aesd_byte_ring
+{
+     char *data;
+     size_t bytes;
+     /**
+      * Offset the next command is stored at
+      */
+     size_t tail;
+};
+
+/**
+ * Scratch space of a writer compressing its commands, grown as needed and kept between writes
+ */
+struct aesd_codec
+{
+     /**
+      * LZ4_MEM_COMPRESS bytes of compressor state
+      */
+     void *work;
+     char *raw;
+     size_t rawCap;
+     char *packed;
+     size_t packedCap;
+};
+
+/**
+ * The last compressed command expanded for a reader, so reading it in several pieces only decompresses it once
+ */
+struct aesd_unpack_cache
+{
+     bool valid;
+     /**
+      * Sequence number of the command in data, unlike its address never reused
+      */
+     uint64_t seq;
+     char *data;
+     size_t cap;
+     /**
+      * Set by a lockless reader that found data too small for a command, the size to grow it to
+      */
+     size_t want;
+};
+
+/**
+ * Per CPU event counters of a device, summed up by the debugfs stats file
+ */
+struct aesd_stats
+{
+     u64 reads;
+     u64 writes;
+     u64 bytesRead;
+     u64 bytesWritten;
+     u64 commands;
+     /**
+      * Commands removed by reads in consume mode
+      */
+     u64 consumed;
+     /**
+      * Bytes written as commands that were stored compressed, and the bytes they take compressed
+      */
+     u64 packedIn;
+     u64 packedOut;
+     /**
+      * Times buffMutex was already held when a writer, ioctl or open wanted it
+      */
+     u64 lockContended;
+};
+
 struct aesd_dev
 {
 
-     struct aesd_circular_buffer *buffer;
+     /**
+      * Readers use it under rcu_read_lock() and retry on seq, writers hold buffMutex.
+      * Replaced (and the old one freed after a grace period) when resized.
+      */
+     struct aesd_circular_buffer __rcu *buffer;
+
+     /**
+      * Bumped around every change to the buffer, so lockless readers can detect and retry torn reads
+      */
+     seqcount_mutex_t seq;
 
-     struct aesd_buffer_entry *tempEntry;
+     /**
+      * Partial command left by a writer that closed before its '\n', adopted by the next file opened write-only
+      * or O_APPEND so "echo -n" followed by "echo" still makes one command. Only one writer's partial command
+      * is kept, others closing while it is pending are dropped. Protected by buffMutex.
+      */
+     struct aesd_stage stage;
 
-     int newEntryFlag;
+     /**
+      * Stores the command bytes when data is set, otherwise each command is its own aesd_entry_data
+      */
+     struct aesd_byte_ring ring;
+
+     /**
+      * Commands are stored LZ4 compressed when that makes them smaller, see aesd_entry_data.packedSize
+      */
+     bool compress;
+
+     /**
+      * Expands compressed commands for buffMutex holders: AESDCHAR_IOCREADENTRIES and the mmap() mirror
+      */
+     struct aesd_unpack_cache unpack;
+
+     /**
+      * Set once the first open() dropped what the buffer held from before
+      */
+     bool bufferCleared;
+
+     /**
+      * vmalloc_user'ed mmap() area, created by the first mmap() and updated by writers under buffMutex
+      */
+     struct aesd_mmap_header *mirror;
 
      struct mutex buffMutex; //Then use mutex_lock() and mutex_unlock()
 
+     /**
+      * Woken, and SIGIO sent to asyncQueue, whenever a write stores at least one command
+      */
+     wait_queue_head_t readQueue;
+     struct fasync_struct *asyncQueue;
+
+     struct aesd_stats __percpu *stats;
+
      struct cdev cdev;     /* Char device structure      */
 };
 
 
+/**
+ * Where the last read() on a file stopped, so a sequential read continues there instead of
+ * searching the buffer again. Only used while fpos and generation still match.
+ */
+struct aesd_read_cursor
+{
+     bool valid;
+     /**
+      * aesd_circular_buffer.generation the indexes below belong to
+      */
+     unsigned long generation;
+     loff_t fpos;
+     size_t entry_index;
+     size_t entry_offset;
+};
+
+/**
+ * Commands pinned by AESDCHAR_IOCSNAPSHOT, each holding a reference to its aesd_entry_data.
+ * Never changes once taken, so reading it needs no device lock.
+ */
+struct aesd_snapshot
+{
+     /**
+      * Sequence numbers of the pinned commands, as returned to userspace
+      */
+     struct aesd_seq_range range;
+     /**
+      * Total bytes, the SEEK_END position while the snapshot is read
+      */
+     size_t size;
+     size_t count;
+     /**
+      * Oldest first, start_offs relative to the first one
+      */
+     struct aesd_buffer_entry entry[];
+};
+
+/**
+ * Per open file state, kept in filp->private_data
+ */
+struct aesd_file
+{
+     struct aesd_dev *dev;
+     struct aesd_read_cursor cursor;
+     /**
+      * This file's command still being written, so concurrent writers on other files never interleave into it
+      */
+     struct aesd_stage stage;
+     /**
+      * Serializes writes sharing this file, the device's buffMutex is only taken to store finished commands
+      */
+     struct mutex writeMutex;
+     /**
+      * Used with writeMutex held when the device compresses
+      */
+     struct aesd_codec codec;
+     /**
+      * Compressed commands this file reads are expanded here
+      */
+     struct aesd_unpack_cache unpack;
+     /**
+      * Set while AESDCHAR_IOCSNAPSHOT has commands pinned for this file
+      */
+     struct aesd_snapshot *snapshot;
+     /**
+      * Protects unpack and snapshot, reads on one file may run concurrently
+      */
+     struct mutex readMutex;
+     /**
+      * Set by AESDCHAR_IOCCONSUME, reads remove the commands they return instead of following the file position
+      */
+     bool consume;
+};
+
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
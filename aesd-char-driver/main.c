@@ -12,35 +12,1185 @@
  */
 
 #include <linux/module.h>
+#include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/refcount.h>
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h"
 
 #include <linux/string.h>
 #include "aesd_ioctl.h"
 #include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/jump_label.h>
+#include <linux/lz4.h>
+#include <linux/version.h>
+
+#define CREATE_TRACE_POINTS
+#include "aesd-trace.h"
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+//Independent devices, minors aesd_minor .. aesd_minor + devices - 1, each with its own buffer and lock
+static uint devices = 1;
+module_param(devices, uint, S_IRUGO);
+MODULE_PARM_DESC(devices, "Number of aesdchar devices (minors), each with its own buffer, lock and counters");
+#define AESD_MAX_DEVICES 64
+
+//Number of write commands kept, can be changed later with AESDCHAR_IOCSETCAPACITY
+static uint buffer_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(buffer_entries, uint, S_IRUGO);
+MODULE_PARM_DESC(buffer_entries, "Number of write commands kept in the circular buffer");
+
+//Byte budget for the stored commands, 0 for none. Can be changed later with AESDCHAR_IOCSETMAXBYTES
+static ulong max_bytes = 0;
+module_param(max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(max_bytes, "Evict the oldest write commands to keep at most this many bytes (0 = no limit)");
+
+//Reads at the end of the data wait for the next command instead of returning 0 (end of file)
+static bool block_reads = false;
+module_param(block_reads, bool, S_IRUGO);
+MODULE_PARM_DESC(block_reads, "Reads at the end of the data wait for new commands unless O_NONBLOCK is set");
+
+//Command bytes of a device in one vmalloc'ed ring instead of one allocation per command
+static ulong ring_bytes = 0;
+module_param(ring_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(ring_bytes, "Store the commands of each device in one contiguous byte ring of this size (0 = one allocation per command)");
+
+//Commands stored LZ4 compressed to keep more history in the same memory, reads expand them again
+static bool compress = false;
+module_param(compress, bool, S_IRUGO);
+MODULE_PARM_DESC(compress, "Store commands LZ4 compressed when that makes them smaller (not with ring_bytes)");
+
+//Compression calls are only compiled in when the kernel has both halves of LZ4
+#define AESD_LZ4_AVAILABLE (IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS))
+//Shorter commands are stored as written, LZ4 can't make them smaller
+#define AESD_PACK_MIN_BYTES 32
+
+//Data ring size of the mmap() area, 0 disables mmap()
+static ulong mmap_bytes = 1024 * 1024;
+module_param(mmap_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(mmap_bytes, "Bytes of stored commands mirrored for mmap(), rounded up to a power of two (0 = no mmap)");
+
+//Records described by the mmap() area, the newest ones are kept if the buffer holds more
+#define AESD_MMAP_RECORD_SLOTS 4096
+#define AESD_MMAP_MAX_DATA_BYTES SZ_1G
+
+//PDEBUG output, off by default. Can be flipped at runtime through /sys/module/aesdchar/parameters/debug
+DEFINE_STATIC_KEY_FALSE(aesd_debug_key);
+
+static int aesd_debug_set(const char *val, const struct kernel_param *kp)
+{
+    bool enable;
+    int result = kstrtobool(val, &enable);
+
+    if (result) {
+        return result;
+    }
+    if (enable) {
+        static_branch_enable(&aesd_debug_key);
+    } else {
+        static_branch_disable(&aesd_debug_key);
+    }
+    return 0;
+}
+
+static int aesd_debug_get(char *buffer, const struct kernel_param *kp)
+{
+    return sprintf(buffer, "%c\n", static_key_enabled(&aesd_debug_key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops aesd_debug_ops = {
+    .set = aesd_debug_set,
+    .get = aesd_debug_get,
+};
+module_param_cb(debug, &aesd_debug_ops, NULL, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(debug, "Print debug messages to the kernel log");
+
+//Holds the stats file, removed with everything in it on unload
+static struct dentry *aesd_debugfs_dir;
+
 MODULE_AUTHOR("Chase O'Connell");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices;
+
+//@return the circular buffer of @param dev for a caller holding buffMutex
+static struct aesd_circular_buffer *aesd_buffer_locked(struct aesd_dev *dev)
+{
+    return rcu_dereference_protected(dev->buffer, lockdep_is_held(&dev->buffMutex));
+}
+
+//@return the minor number of @param dev
+static unsigned int aesd_dev_minor(struct aesd_dev *dev)
+{
+    return aesd_minor + (dev - aesd_devices);
+}
+
+//Counts and traces having to wait for buffMutex, called when mutex_trylock() failed
+static void aesd_lock_contended(struct aesd_dev *dev)
+{
+    this_cpu_inc(dev->stats->lockContended);
+    trace_aesd_lock_contended(aesd_dev_minor(dev));
+}
+
+//Takes buffMutex of @param dev, a trylock first so contention shows up in the stats
+static void aesd_lock(struct aesd_dev *dev)
+{
+    if (!mutex_trylock(&dev->buffMutex)) {
+        aesd_lock_contended(dev);
+        mutex_lock(&dev->buffMutex);
+    }
+}
+
+//Like aesd_lock(), @return 0 or -ERESTARTSYS if a signal interrupted the wait
+static int aesd_lock_interruptible(struct aesd_dev *dev)
+{
+    if (!mutex_trylock(&dev->buffMutex)) {
+        aesd_lock_contended(dev);
+        if (mutex_lock_interruptible(&dev->buffMutex)) {
+            return -ERESTARTSYS;
+        }
+    }
+    return 0;
+}
+
+//Drops a reference to a command's bytes. The last one frees them after a grace period, lockless readers
+//may still be copying them.
+static void aesd_entry_put(struct aesd_entry_data *data)
+{
+    if (refcount_dec_and_test(&data->refs)) {
+        kvfree_rcu(data, rcu);
+    }
+}
+
+//Drops the buffer's reference to a stored command's bytes, a snapshot may still hold them.
+//Bytes in the byte ring of @param dev need no freeing, they are reused once the entry is gone.
+static void aesd_entry_free(struct aesd_dev *dev, const char *buffptr)
+{
+    if (buffptr && dev->ring.data == NULL) {
+        aesd_entry_put(aesd_entry_data_of(buffptr));
+    }
+}
 
 //Reference: Asked ChatGPT for a helper function as my circular buffer kept the same contents between runs
-static bool bufferCleared = false;
-void clear_circular_buffer(void)
+void clear_circular_buffer(struct aesd_dev *dev)
+{
+    struct aesd_circular_buffer *buffer = rcu_dereference_protected(dev->buffer, true);
+
+    //Frees every stored entry, oldest first
+    while (aesd_circular_buffer_count(buffer)) {
+        aesd_entry_free(dev, aesd_circular_buffer_remove_entry(buffer));
+    }
+}
+
+//Frees the buffer of @param dev with everything it stores, no readers are left
+static void aesd_buffer_free(struct aesd_dev *dev)
+{
+    struct aesd_circular_buffer *buffer = rcu_dereference_protected(dev->buffer, true);
+
+    clear_circular_buffer(dev);
+    if (buffer->entry != buffer->inline_entry) {
+        kvfree(buffer->entry);
+    }
+    kfree(buffer);
+}
+
+//Frees every chunk of @param stage, leaving it empty
+static void aesd_stage_free(struct aesd_stage *stage)
+{
+    struct aesd_stage_chunk *chunk, *tmp;
+
+    list_for_each_entry_safe(chunk, tmp, &stage->chunks, list) {
+        list_del(&chunk->list);
+        kfree(chunk);
+    }
+    stage->size = 0;
+}
+
+//Cuts @param stage back to its first @param size bytes, used to undo a failed write
+static void aesd_stage_truncate(struct aesd_stage *stage, size_t size)
+{
+    while (!list_empty(&stage->chunks)) {
+        struct aesd_stage_chunk *last = list_last_entry(&stage->chunks, struct aesd_stage_chunk, list);
+        size_t drop = min(last->used - last->head, stage->size - size);
+
+        last->used -= drop;
+        stage->size -= drop;
+        if (last->used != last->head) {
+            break;
+        }
+        list_del(&last->list);
+        kfree(last);
+    }
+}
+
+//Moves every staged byte of @param from to the end of @param to, leaving from empty
+static void aesd_stage_move(struct aesd_stage *from, struct aesd_stage *to)
+{
+    list_splice_tail_init(&from->chunks, &to->chunks);
+    to->size += from->size;
+    from->size = 0;
+}
+
+//@return the last chunk of @param stage if it has room, otherwise a new page sized chunk added to it, NULL if out of memory
+static struct aesd_stage_chunk *aesd_stage_tail(struct aesd_stage *stage)
+{
+    struct aesd_stage_chunk *chunk;
+
+    if (!list_empty(&stage->chunks)) {
+        chunk = list_last_entry(&stage->chunks, struct aesd_stage_chunk, list);
+        if (chunk->used < AESD_STAGE_CHUNK_BYTES) {
+            return chunk;
+        }
+    }
+
+    chunk = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->head = 0;
+    chunk->used = 0;
+    list_add_tail(&chunk->list, &stage->chunks);
+    return chunk;
+}
+
+//Copies the first @param size staged bytes of @param stage to @param data, leaving them staged
+static void aesd_stage_copy(struct aesd_stage *stage, char *data, size_t size)
+{
+    struct aesd_stage_chunk *chunk;
+    size_t position = 0;
+
+    list_for_each_entry(chunk, &stage->chunks, list) {
+        if (position == size) {
+            break;
+        }
+        size_t take = min(chunk->used - chunk->head, size - position);
+        memcpy(data + position, chunk->data + chunk->head, take);
+        position += take;
+    }
+}
+
+/**
+ * Copies the first @param size staged bytes of @param stage to @param data, unless it is NULL, and removes
+ * them from the stage. Drained chunks are freed, except the last one which is kept (emptied) for the next
+ * bytes, so pointers into it stay valid.
+ */
+static void aesd_stage_take(struct aesd_stage *stage, char *data, size_t size)
+{
+    struct aesd_stage_chunk *chunk, *tmp;
+    size_t position = 0;
+
+    list_for_each_entry_safe(chunk, tmp, &stage->chunks, list) {
+        if (position == size) {
+            break;
+        }
+        size_t take = min(chunk->used - chunk->head, size - position);
+        if (data) {
+            memcpy(data + position, chunk->data + chunk->head, take);
+        }
+        position += take;
+        chunk->head += take;
+
+        if (chunk->head == chunk->used) {
+            if (list_is_last(&chunk->list, &stage->chunks)) {
+                chunk->head = 0;
+                chunk->used = 0;
+            } else {
+                list_del(&chunk->list);
+                kfree(chunk);
+            }
+        }
+    }
+    stage->size -= size;
+}
+
+/**
+ * Moves the first @param size staged bytes of @param stage into one kvmalloc'ed aesd_entry_data,
+ * described by @param entry.
+ * @return 0, or -ENOMEM with the stage left as it was
+ */
+static int aesd_stage_commit(struct aesd_stage *stage, struct aesd_buffer_entry *entry, size_t size)
 {
-    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-        kfree(aesd_device.buffer->entry[i].buffptr);  // Free each buffer entry
-        aesd_device.buffer->entry[i].buffptr = NULL;   // Null out the pointer
-        aesd_device.buffer->entry[i].size = 0;         // Reset the size
+    struct aesd_entry_data *entryData = kvmalloc(struct_size(entryData, data, size), GFP_KERNEL);
+    if (entryData == NULL) {
+        return -ENOMEM;
     }
+    entryData->size = size;
+    entryData->packedSize = 0;
+    refcount_set(&entryData->refs, 1);
+    aesd_stage_take(stage, entryData->data, size);
+
+    entry->buffptr = entryData->data;
+    entry->size = size;
+    return 0;
+}
+
+//Grows the scratch buffer @param buf to at least @param size bytes, its contents are not kept.
+//@return 0 or -ENOMEM
+static int aesd_scratch_reserve(char **buf, size_t *cap, size_t size)
+{
+    if (*cap >= size) {
+        return 0;
+    }
+    kvfree(*buf);
+    *buf = kvmalloc(size, GFP_KERNEL);
+    *cap = *buf ? size : 0;
+    return *buf ? 0 : -ENOMEM;
+}
+
+/**
+ * Like aesd_stage_commit(), but stores the command LZ4 compressed when that makes it smaller, with
+ * @param codec of the writer as scratch space.
+ * @return 0, or -ENOMEM with the stage left as it was
+ */
+static int aesd_stage_commit_packed(struct aesd_stage *stage, struct aesd_codec *codec,
+            struct aesd_buffer_entry *entry, size_t size)
+{
+    struct aesd_entry_data *entryData;
+    int packedSize;
+
+    if (!AESD_LZ4_AVAILABLE || size < AESD_PACK_MIN_BYTES || size > LZ4_MAX_INPUT_SIZE) {
+        return aesd_stage_commit(stage, entry, size);
+    }
+    if (codec->work == NULL) {
+        codec->work = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+        if (codec->work == NULL) {
+            return -ENOMEM;
+        }
+    }
+    //Output that is not smaller than the input is of no use, so no room for LZ4_compressBound()
+    if (aesd_scratch_reserve(&codec->raw, &codec->rawCap, size) ||
+            aesd_scratch_reserve(&codec->packed, &codec->packedCap, size - 1)) {
+        return -ENOMEM;
+    }
+    aesd_stage_copy(stage, codec->raw, size);
+    packedSize = LZ4_compress_default(codec->raw, codec->packed, size, size - 1, codec->work);
+
+    //0 when it did not fit, the command is then stored as written
+    size_t storedSize = packedSize > 0 ? packedSize : size;
+    entryData = kvmalloc(struct_size(entryData, data, storedSize), GFP_KERNEL);
+    if (entryData == NULL) {
+        return -ENOMEM;
+    }
+    entryData->size = size;
+    entryData->packedSize = packedSize > 0 ? packedSize : 0;
+    refcount_set(&entryData->refs, 1);
+    memcpy(entryData->data, packedSize > 0 ? codec->packed : codec->raw, storedSize);
+    aesd_stage_take(stage, NULL, size);
+
+    entry->buffptr = entryData->data;
+    entry->size = size;
+    return 0;
+}
+
+//@return the stored form of the command at @param buffptr of @param dev if it is compressed, otherwise NULL
+static const struct aesd_entry_data *aesd_packed_data(struct aesd_dev *dev, const char *buffptr)
+{
+    if (!AESD_LZ4_AVAILABLE || !dev->compress) {
+        return NULL;
+    }
+    const struct aesd_entry_data *data = aesd_entry_data_of(buffptr);
+    return data->packedSize ? data : NULL;
+}
+
+//Expands the compressed command @param data into @param out, which has room for data->size bytes.
+//Never sleeps, so lockless readers use it under rcu_read_lock(). @return 0 or -EIO
+static int aesd_unpack(const struct aesd_entry_data *data, char *out)
+{
+    if (!AESD_LZ4_AVAILABLE) {
+        return -EIO;
+    }
+    return LZ4_decompress_safe(data->data, out, data->packedSize, data->size) == data->size ? 0 : -EIO;
+}
+
+/**
+ * @return the bytes of @param entry of @param dev as written, expanded into @param cache if it is stored
+ * compressed, or NULL if that fails. Valid until the next call with the same cache.
+ */
+static const char *aesd_entry_bytes(struct aesd_dev *dev, const struct aesd_buffer_entry *entry,
+            struct aesd_unpack_cache *cache)
+{
+    const struct aesd_entry_data *data = aesd_packed_data(dev, entry->buffptr);
+
+    if (data == NULL) {
+        return entry->buffptr;
+    }
+    if (cache->valid && cache->seq == entry->seq) {
+        return cache->data;
+    }
+    cache->valid = false;
+    if (aesd_scratch_reserve(&cache->data, &cache->cap, data->size) || aesd_unpack(data, cache->data)) {
+        return NULL;
+    }
+    cache->seq = entry->seq;
+    cache->valid = true;
+    return cache->data;
+}
+
+//aesd_entry_bytes() with the unpack cache of @param dev, must be called with buffMutex held
+static const char *aesd_entry_bytes_locked(struct aesd_dev *dev, const struct aesd_buffer_entry *entry)
+{
+    return aesd_entry_bytes(dev, entry, &dev->unpack);
+}
+
+/**
+ * Finds room for a @param size byte command in the byte ring of @param dev, evicting the oldest commands
+ * whose bytes are in the way. Must be called with buffMutex held, inside a seqcount write section.
+ * @return where the command goes, NULL if it is larger than the whole ring
+ */
+static char *aesd_ring_reserve(struct aesd_dev *dev, size_t size)
+{
+    struct aesd_byte_ring *ring = &dev->ring;
+    struct aesd_circular_buffer *buffer = aesd_buffer_locked(dev);
+
+    if (size > ring->bytes) {
+        return NULL;
+    }
+
+    while (aesd_circular_buffer_count(buffer)) {
+        size_t head = aesd_circular_buffer_entry_at(buffer, 0)->buffptr - ring->data;
+
+        if (ring->tail > head) {
+            //Used bytes are head .. tail, free ones after tail and before head
+            if (ring->bytes - ring->tail >= size) {
+                return ring->data + ring->tail;
+            }
+            if (head >= size) {
+                return ring->data;
+            }
+        } else if (head - ring->tail >= size) {
+            //Wrapped, free bytes are tail .. head (none if they meet)
+            return ring->data + ring->tail;
+        }
+        aesd_circular_buffer_evict_oldest(buffer);
+    }
+    return ring->data;
+}
+
+/**
+ * Moves the first @param size staged bytes of @param stage into the byte ring of @param dev, described by
+ * @param entry. Must be called with buffMutex held.
+ * @return 0, or -ENOSPC with the stage left as it was if the command is larger than the ring
+ */
+static int aesd_ring_commit(struct aesd_dev *dev, struct aesd_stage *stage, struct aesd_buffer_entry *entry,
+            size_t size)
+{
+    //Evicting what is in the way changes the buffer
+    write_seqcount_begin(&dev->seq);
+    char *data = aesd_ring_reserve(dev, size);
+    write_seqcount_end(&dev->seq);
+    if (data == NULL) {
+        return -ENOSPC;
+    }
+
+    //Readers that started before the evictions retry, later ones never look at these bytes
+    aesd_stage_take(stage, data, size);
+    dev->ring.tail = data + size - dev->ring.data;
+
+    entry->buffptr = data;
+    entry->size = size;
+    return 0;
+}
+
+//Marks the mmap() area of @param header as being updated, userspace retries while seq is odd
+static void aesd_mirror_begin(struct aesd_mmap_header *header)
+{
+    WRITE_ONCE(header->seq, header->seq + 1);
+    smp_wmb();
+}
+
+static void aesd_mirror_end(struct aesd_mmap_header *header)
+{
+    smp_wmb();
+    WRITE_ONCE(header->seq, header->seq + 1);
+}
+
+/**
+ * Copies the newly stored command @param entry into the mmap() area of @param dev, if there is one,
+ * dropping the oldest records whose bytes or descriptor slot it reuses. A command larger than the whole
+ * data ring, or a compressed one that can't be expanded, empties the mirror and is only counted.
+ * Must be called with buffMutex held.
+ */
+static void aesd_mirror_append(struct aesd_dev *dev, const struct aesd_buffer_entry *entry)
+{
+    struct aesd_mmap_header *header = dev->mirror;
+    if (header == NULL) {
+        return;
+    }
+    const char *buffptr = aesd_entry_bytes_locked(dev, entry);
+    size_t size = entry->size;
+    struct aesd_mmap_record *records = (void *)header + header->records_offset;
+    char *ring = (char *)header + header->data_offset;
+    uint64_t slotMask = header->record_slots - 1;
+    uint64_t first = header->first_record;
+    uint64_t next = header->next_record;
+    uint64_t dataEnd = header->data_end;
+
+    aesd_mirror_begin(header);
+    if (buffptr == NULL || size > header->data_bytes) {
+        first = next + 1;
+    } else {
+        while (first < next && (records[first & slotMask].offset + header->data_bytes < dataEnd + size ||
+                    next - first >= header->record_slots)) {
+            first++;
+        }
+
+        size_t ringPos = dataEnd & (header->data_bytes - 1);
+        size_t toEnd = min_t(size_t, size, header->data_bytes - ringPos);
+        memcpy(ring + ringPos, buffptr, toEnd);
+        memcpy(ring, buffptr + toEnd, size - toEnd);
+
+        records[next & slotMask].offset = dataEnd;
+        records[next & slotMask].size = size;
+        WRITE_ONCE(header->data_end, dataEnd + size);
+    }
+    WRITE_ONCE(header->first_record, first);
+    WRITE_ONCE(header->next_record, next + 1);
+    aesd_mirror_end(header);
+}
+
+/**
+ * Drops records from the mmap() area of @param dev that are no longer in its buffer, after evictions,
+ * a capacity change or a lower byte budget. Must be called with buffMutex held.
+ */
+static void aesd_mirror_sync(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header = dev->mirror;
+    if (header == NULL) {
+        return;
+    }
+    uint64_t count = aesd_circular_buffer_count(aesd_buffer_locked(dev));
+    if (header->next_record - header->first_record > count) {
+        aesd_mirror_begin(header);
+        WRITE_ONCE(header->first_record, header->next_record - count);
+        aesd_mirror_end(header);
+    }
+}
+
+/**
+ * Allocates the mmap() area of @param dev: a header page, the record descriptors and a data ring of
+ * mmap_bytes rounded up to a power of two, then mirrors the commands already stored.
+ * Must be called with buffMutex held.
+ * @return 0, -ENODEV if mmap() is disabled or -ENOMEM
+ */
+static int aesd_mirror_create(struct aesd_dev *dev)
+{
+    struct aesd_circular_buffer *buffer = aesd_buffer_locked(dev);
+    size_t index;
+
+    if (mmap_bytes == 0 || mmap_bytes > AESD_MMAP_MAX_DATA_BYTES) {
+        return -ENODEV;
+    }
+    size_t recordsOffset = PAGE_ALIGN(sizeof(struct aesd_mmap_header));
+    size_t dataOffset = recordsOffset + PAGE_ALIGN(AESD_MMAP_RECORD_SLOTS * sizeof(struct aesd_mmap_record));
+    size_t dataBytes = roundup_pow_of_two(mmap_bytes);
+
+    struct aesd_mmap_header *header = vmalloc_user(dataOffset + dataBytes);
+    if (header == NULL) {
+        return -ENOMEM;
+    }
+    header->magic = AESDCHAR_MMAP_MAGIC;
+    header->record_slots = AESD_MMAP_RECORD_SLOTS;
+    header->records_offset = recordsOffset;
+    header->data_offset = dataOffset;
+    header->data_bytes = dataBytes;
+    header->first_record = aesd_circular_buffer_oldest_seq(buffer);
+    header->next_record = header->first_record;
+    dev->mirror = header;
+
+    //Oldest first, so record numbers are the sequence numbers of the commands
+    for (index = 0; index < aesd_circular_buffer_count(buffer); index++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, index);
+        aesd_mirror_append(dev, entry);
+    }
+    return 0;
+}
+
+/**
+ * Appends the bytes left in @param from to @param stage, a page sized chunk at a time, and stores every
+ * command completed by a '\n' as its own entry of @param dev. Bytes after the last newline stay staged
+ * for the next write, commands are compressed with @param codec unless it is NULL. Readers waiting for data
+ * are woken if any command was stored.
+ * Must be called with the stage's writeMutex held, buffMutex is only taken to store each command.
+ * @return bytes accepted, which is short of count if copying or storing a command fails part way,
+ * or -EFAULT / -ENOMEM if nothing was accepted (the stage is then unchanged)
+ */
+static ssize_t aesd_write_commands(struct aesd_dev *dev, struct aesd_stage *stage, struct aesd_codec *codec,
+            struct iov_iter *from)
+{
+    size_t count = iov_iter_count(from);
+    size_t accepted = 0;
+    bool committed = false;
+    int status = 0;
+
+    while (accepted < count && status == 0) {
+        struct aesd_stage_chunk *chunk = aesd_stage_tail(stage);
+        if (chunk == NULL) {
+            status = -ENOMEM;
+            break;
+        }
+
+        size_t toCopy = min(count - accepted, AESD_STAGE_CHUNK_BYTES - chunk->used);
+        char *copied = chunk->data + chunk->used;
+        //A short copy means a bad user address, whatever came over is ignored like a failed copy_from_user()
+        if (copy_from_iter(copied, toCopy, from) != toCopy) {
+            status = -EFAULT;
+            break;
+        }
+        chunk->used += toCopy;
+        stage->size += toCopy;
+
+        //Each '\n' in what was just copied completes a command
+        size_t scanned = 0;
+        char *newline;
+        while ((newline = memchr(copied + scanned, '\n', toCopy - scanned)) != NULL) {
+            size_t lineEnd = newline + 1 - copied;
+            size_t commandSize = stage->size - (toCopy - lineEnd);
+            struct aesd_buffer_entry newEntry;
+
+            //Byte ring room is only made under buffMutex, a separate allocation is made before taking it
+            if (dev->ring.data) {
+                aesd_lock(dev);
+                status = aesd_ring_commit(dev, stage, &newEntry, commandSize);
+                if (status) {
+                    mutex_unlock(&dev->buffMutex);
+                }
+            } else {
+                status = codec ? aesd_stage_commit_packed(stage, codec, &newEntry, commandSize) :
+                            aesd_stage_commit(stage, &newEntry, commandSize);
+                if (status == 0) {
+                    aesd_lock(dev);
+                }
+            }
+            if (status) {
+                //Keep what precedes the newline staged, the writer sees a short write and retries from there
+                aesd_stage_truncate(stage, commandSize - 1);
+                toCopy = lineEnd - 1;
+                break;
+            }
+
+            //Add entry to the circular buffer, lockless readers retry if they overlap this
+            write_seqcount_begin(&dev->seq);
+            const char* overwrittenEntryBuff = aesd_circular_buffer_add_entry(aesd_buffer_locked(dev), &newEntry);
+            write_seqcount_end(&dev->seq);
+            trace_aesd_commit(aesd_dev_minor(dev), aesd_buffer_locked(dev)->next_seq - 1, newEntry.size);
+            this_cpu_inc(dev->stats->commands);
+            const struct aesd_entry_data *packed = aesd_packed_data(dev, newEntry.buffptr);
+            if (packed) {
+                this_cpu_add(dev->stats->packedIn, packed->size);
+                this_cpu_add(dev->stats->packedOut, packed->packedSize);
+            }
+
+            //Should free the overwritten entry (only returned here if no evict callback is set)
+            if (overwrittenEntryBuff) { //Reference: Added check so kfree doesn't try to free 'NULL' when debugging with Copilot AI
+                aesd_entry_free(dev, overwrittenEntryBuff);
+            }
+            aesd_mirror_append(dev, aesd_circular_buffer_entry_at(aesd_buffer_locked(dev),
+                        aesd_circular_buffer_count(aesd_buffer_locked(dev)) - 1));
+            aesd_mirror_sync(dev);
+            mutex_unlock(&dev->buffMutex);
+            committed = true;
+            scanned = lineEnd;
+        }
+        accepted += toCopy;
+    }
+
+    if (committed) {
+        wake_up_interruptible(&dev->readQueue);
+        kill_fasync(&dev->asyncQueue, SIGIO, POLL_IN);
+    }
+
+    return accepted ? accepted : status;
+}
+
+//Eviction callback of the circular buffer, frees the entry's memory after a grace period.
+//Called with buffMutex held inside a seqcount write section.
+static void aesd_evict_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry)
+{
+    trace_aesd_evict(entry->seq, entry->size);
+    aesd_entry_put(aesd_entry_data_of(entry->buffptr));
+    entry->buffptr = NULL;
+}
+
+//Eviction callback with byte ring storage, nothing to free: the bytes are reused once the entry is gone
+static void aesd_evict_ring_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry)
+{
+    trace_aesd_evict(entry->seq, entry->size);
+    entry->buffptr = NULL;
+}
+
+/**
+ * @return the size of the command at @param buffptr, read from @param entry, bounded by what its storage
+ * holds so a reader racing a writer never copies past it
+ */
+static size_t aesd_stored_size(struct aesd_dev *dev, const struct aesd_buffer_entry *entry, const char *buffptr)
+{
+    if (dev->ring.data) {
+        return min_t(size_t, READ_ONCE(entry->size), dev->ring.data + dev->ring.bytes - buffptr);
+    }
+    return aesd_entry_data_of(buffptr)->size;
+}
+
+/**
+ * Copies up to @param count bytes starting at @param pos into @param bounce without taking buffMutex.
+ * Runs under rcu_read_lock() so no entry or buffer can be freed meanwhile, and starts over if a writer
+ * changed the buffer, so the bytes always come from one consistent state. Copies are bounded by the
+ * immutable aesd_entry_data size or the byte ring, never by fields a concurrent writer may have half updated.
+ * Adjacent entries, as in the byte ring, are copied with a single memcpy().
+ * @param cursor where the previous copy on this file stopped. Used instead of searching when it
+ * matches pos and the buffer generation, and updated to where this copy stops.
+ * @param cache expands compressed commands. Only trusted once the copy that filled it did not have to start
+ * over. If it is too small for the next command the copy stops there and sets cache->want.
+ * @return bytes copied, 0 at the end of the data
+ */
+static size_t aesd_copy_lockless(struct aesd_dev *dev, loff_t pos, char *bounce, size_t count,
+            struct aesd_read_cursor *cursor, struct aesd_unpack_cache *cache)
+{
+    struct aesd_read_cursor newCursor;
+    unsigned int seq;
+    size_t copied;
+    bool filled;
+
+    rcu_read_lock();
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        struct aesd_circular_buffer *buffer = rcu_dereference(dev->buffer);
+        size_t entryIndex, entryOffset;
+
+        copied = 0;
+        filled = false;
+        newCursor.valid = false;
+        newCursor.generation = buffer->generation;
+        if (cursor->valid && cursor->fpos == pos && cursor->generation == newCursor.generation) {
+            entryIndex = cursor->entry_index;
+            entryOffset = cursor->entry_offset;
+        } else if (aesd_circular_buffer_find_index_for_fpos(buffer, pos, &entryIndex, &entryOffset) != 0) {
+            continue;
+        }
+
+        //Walk forward entry by entry, no search per chunk. Bytes that continue the previous run are
+        //only copied once the run ends.
+        const char *runStart = NULL;
+        size_t runLength = 0;
+        while (copied < count && entryIndex < aesd_circular_buffer_count(buffer)) {
+            struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, entryIndex);
+            const char *buffptr = READ_ONCE(entry->buffptr);
+            if (!buffptr) {
+                break;
+            }
+            size_t entrySize = aesd_stored_size(dev, entry, buffptr);
+            if (entryOffset >= entrySize) {
+                break;
+            }
+            size_t bytesToCopy = min(count - copied, entrySize - entryOffset);
+            const struct aesd_entry_data *packed = aesd_packed_data(dev, buffptr);
+            if (packed) {
+                //Expanded bytes never continue a run
+                if (runLength) {
+                    memcpy(bounce + copied - runLength, runStart, runLength);
+                    runLength = 0;
+                }
+                uint64_t entrySeq = READ_ONCE(entry->seq);
+                if (!cache->valid || cache->seq != entrySeq) {
+                    if (cache->cap < entrySize) {
+                        cache->want = entrySize;
+                        break;
+                    }
+                    cache->valid = false;
+                    if (aesd_unpack(packed, cache->data)) {
+                        break;
+                    }
+                    cache->seq = entrySeq;
+                    filled = true;
+                }
+                memcpy(bounce + copied, cache->data + entryOffset, bytesToCopy);
+            } else {
+                if (runLength == 0 || runStart + runLength != buffptr + entryOffset) {
+                    if (runLength) {
+                        memcpy(bounce + copied - runLength, runStart, runLength);
+                    }
+                    runStart = buffptr + entryOffset;
+                    runLength = 0;
+                }
+                runLength += bytesToCopy;
+            }
+            copied += bytesToCopy;
+            entryOffset += bytesToCopy;
+            if (entryOffset == entrySize) {
+                entryIndex++;
+                entryOffset = 0;
+            }
+        }
+        if (runLength) {
+            memcpy(bounce + copied - runLength, runStart, runLength);
+        }
+
+        newCursor.valid = true;
+        newCursor.fpos = pos + copied;
+        newCursor.entry_index = entryIndex;
+        newCursor.entry_offset = entryOffset;
+    } while (read_seqcount_retry(&dev->seq, seq));
+    rcu_read_unlock();
+
+    if (filled) {
+        cache->valid = true;
+    }
+    *cursor = newCursor;
+    return copied;
+}
+
+/**
+ * @return true if a read at @param pos would return data right now. Lockless like aesd_copy_lockless().
+ */
+static bool aesd_data_after(struct aesd_dev *dev, loff_t pos)
+{
+    unsigned int seq;
+    bool available;
+
+    rcu_read_lock();
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        available = pos < rcu_dereference(dev->buffer)->size;
+    } while (read_seqcount_retry(&dev->seq, seq));
+    rcu_read_unlock();
+
+    return available;
+}
+
+//Fills the counters of @param info from @param buffer, leaves the sizes request alone
+static void aesd_fill_info(struct aesd_circular_buffer *buffer, struct aesd_info *info)
+{
+    info->count = aesd_circular_buffer_count(buffer);
+    info->capacity = buffer->capacity;
+    info->bytes = buffer->size;
+    info->max_bytes = buffer->max_bytes;
+    info->oldest_seq = aesd_circular_buffer_oldest_seq(buffer);
+    info->next_seq = buffer->next_seq;
+    info->evicted_entries = buffer->evicted_entries;
+    info->evicted_bytes = buffer->evicted_bytes;
+}
+
+/**
+ * Shows the buffer usage and eviction counters of every device in /proc/aesdchar
+ */
+static int aesd_proc_show(struct seq_file *m, void *v)
+{
+    unsigned int index;
+
+    for (index = 0; index < devices; index++) {
+        struct aesd_dev *dev = &aesd_devices[index];
+
+        if (mutex_lock_interruptible(&dev->buffMutex)) {
+            return -ERESTARTSYS;
+        }
+        struct aesd_info info;
+        aesd_fill_info(aesd_buffer_locked(dev), &info);
+        mutex_unlock(&dev->buffMutex);
+
+        seq_printf(m, "device: %u\n", aesd_minor + index);
+        seq_printf(m, "entries: %u\n", info.count);
+        seq_printf(m, "capacity: %u\n", info.capacity);
+        seq_printf(m, "bytes: %llu\n", (unsigned long long)info.bytes);
+        seq_printf(m, "max_bytes: %llu\n", (unsigned long long)info.max_bytes);
+        seq_printf(m, "oldest_seq: %llu\n", (unsigned long long)info.oldest_seq);
+        seq_printf(m, "next_seq: %llu\n", (unsigned long long)info.next_seq);
+        seq_printf(m, "evicted_entries: %llu\n", (unsigned long long)info.evicted_entries);
+        seq_printf(m, "evicted_bytes: %llu\n", (unsigned long long)info.evicted_bytes);
+    }
+
+    return 0;
+}
+
+/**
+ * Shows the event counters of every device in <debugfs>/aesdchar/stats, summed over all CPUs
+ */
+static int aesd_stats_show(struct seq_file *m, void *v)
+{
+    unsigned int index;
+    int cpu;
+
+    for (index = 0; index < devices; index++) {
+        struct aesd_dev *dev = &aesd_devices[index];
+        struct aesd_stats total = {0};
+
+        //Not aesd_lock(), looking at the counters should not count as contention
+        if (mutex_lock_interruptible(&dev->buffMutex)) {
+            return -ERESTARTSYS;
+        }
+        struct aesd_info info;
+        aesd_fill_info(aesd_buffer_locked(dev), &info);
+        mutex_unlock(&dev->buffMutex);
+
+        for_each_possible_cpu(cpu) {
+            struct aesd_stats *stats = per_cpu_ptr(dev->stats, cpu);
+            total.reads += stats->reads;
+            total.writes += stats->writes;
+            total.bytesRead += stats->bytesRead;
+            total.bytesWritten += stats->bytesWritten;
+            total.commands += stats->commands;
+            total.consumed += stats->consumed;
+            total.packedIn += stats->packedIn;
+            total.packedOut += stats->packedOut;
+            total.lockContended += stats->lockContended;
+        }
+
+        seq_printf(m, "device: %u\n", aesd_minor + index);
+        seq_printf(m, "reads: %llu\n", total.reads);
+        seq_printf(m, "writes: %llu\n", total.writes);
+        seq_printf(m, "bytes_read: %llu\n", total.bytesRead);
+        seq_printf(m, "bytes_written: %llu\n", total.bytesWritten);
+        seq_printf(m, "commands: %llu\n", total.commands);
+        seq_printf(m, "consumed: %llu\n", total.consumed);
+        seq_printf(m, "packed_bytes_in: %llu\n", total.packedIn);
+        seq_printf(m, "packed_bytes_out: %llu\n", total.packedOut);
+        seq_printf(m, "evicted_entries: %llu\n", (unsigned long long)info.evicted_entries);
+        seq_printf(m, "evicted_bytes: %llu\n", (unsigned long long)info.evicted_bytes);
+        seq_printf(m, "lock_contended: %llu\n", total.lockContended);
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+/**
+ * Changes how many write commands @param dev keeps to @param capacity, dropping the oldest ones
+ * if more than that are stored. Capacities up to AESD_CIRCULAR_BUFFER_INLINE_SLOTS use the
+ * buffer's own slots, larger ones a kvmalloc'ed power of two slot array.
+ * Lockless readers may be walking the current buffer, so the resized one is built as a copy, published
+ * with rcu_assign_pointer() and the old one freed after a grace period.
+ * Must be called with buffMutex held.
+ * @return 0 on success, -EINVAL or -ENOMEM on failure
+ */
+static int aesd_buffer_resize(struct aesd_dev *dev, uint32_t capacity)
+{
+    struct aesd_circular_buffer *buffer = aesd_buffer_locked(dev);
+    struct aesd_circular_buffer *newBuffer;
+    struct aesd_buffer_entry *newEntry;
+    uint32_t slots;
+
+    if (capacity == 0 || capacity > AESDCHAR_MAX_BUFFER_ENTRIES) {
+        return -EINVAL;
+    }
+
+    newBuffer = kmalloc(sizeof(*newBuffer), GFP_KERNEL);
+    if (newBuffer == NULL) {
+        return -ENOMEM;
+    }
+    if (capacity <= AESD_CIRCULAR_BUFFER_INLINE_SLOTS) {
+        newEntry = newBuffer->inline_entry;
+        slots = AESD_CIRCULAR_BUFFER_INLINE_SLOTS;
+    } else {
+        slots = aesd_circular_buffer_slots_for(capacity);
+        newEntry = kvmalloc_array(slots, sizeof(*newEntry), GFP_KERNEL);
+        if (newEntry == NULL) {
+            kfree(newBuffer);
+            return -ENOMEM;
+        }
+    }
+
+    //Dropping the oldest entries changes the live buffer
+    write_seqcount_begin(&dev->seq);
+    while (aesd_circular_buffer_count(buffer) > capacity) {
+        aesd_entry_free(dev, aesd_circular_buffer_remove_entry(buffer));
+    }
+    write_seqcount_end(&dev->seq);
+    aesd_mirror_sync(dev);
+
+    //The copy only reads the live slots, and shares them if just the capacity changes
+    *newBuffer = *buffer;
+    if (buffer->entry == buffer->inline_entry) {
+        newBuffer->entry = newBuffer->inline_entry;
+    }
+    struct aesd_buffer_entry *oldEntry = aesd_circular_buffer_resize(newBuffer, newEntry, slots, capacity);
+    if (oldEntry == NULL) {
+        if (newEntry != newBuffer->inline_entry) {
+            kvfree(newEntry);
+        }
+        kfree(newBuffer);
+        return -EINVAL;
+    }
+
+    write_seqcount_begin(&dev->seq);
+    rcu_assign_pointer(dev->buffer, newBuffer);
+    write_seqcount_end(&dev->seq);
+
+    synchronize_rcu();
+    if (oldEntry != newBuffer->inline_entry && oldEntry != newEntry) {
+        kvfree(oldEntry);
+    }
+    kfree(buffer);
+
+    PDEBUG("Buffer capacity now %u entries in %u slots\n", capacity, slots);
+    return 0;
+}
+
+/**
+ * Gives @param pinned its own reference to the bytes of @param entry of @param dev, so they outlive the entry.
+ * Commands in the byte ring are copied since their bytes get reused. Called with buffMutex held.
+ * @return 0 or -ENOMEM
+ */
+static int aesd_entry_pin(struct aesd_dev *dev, const struct aesd_buffer_entry *entry,
+            struct aesd_buffer_entry *pinned)
+{
+    struct aesd_entry_data *data;
+
+    if (dev->ring.data) {
+        data = kvmalloc(struct_size(data, data, entry->size), GFP_KERNEL);
+        if (data == NULL) {
+            return -ENOMEM;
+        }
+        data->size = entry->size;
+        data->packedSize = 0;
+        refcount_set(&data->refs, 1);
+        memcpy(data->data, entry->buffptr, entry->size);
+    } else {
+        data = aesd_entry_data_of(entry->buffptr);
+        refcount_inc(&data->refs);
+    }
+    pinned->buffptr = data->data;
+    pinned->size = entry->size;
+    pinned->seq = entry->seq;
+    return 0;
+}
+
+//Drops the references of @param snapshot and frees it
+static void aesd_snapshot_free(struct aesd_snapshot *snapshot)
+{
+    size_t index;
+
+    if (snapshot == NULL) {
+        return;
+    }
+    for (index = 0; index < snapshot->count; index++) {
+        aesd_entry_put(aesd_entry_data_of(snapshot->entry[index].buffptr));
+    }
+    kvfree(snapshot);
+}
+
+/**
+ * Pins the commands @param dev stores right now in a new snapshot, returned in @param snapshotRtn.
+ * Stored commands just gain a reference, those in the byte ring are copied since their bytes get reused.
+ * Writers only wait for this, not for the reads of the snapshot.
+ * @return 0, -ENOMEM or -ERESTARTSYS
+ */
+static int aesd_snapshot_take(struct aesd_dev *dev, struct aesd_snapshot **snapshotRtn)
+{
+    struct aesd_snapshot *snapshot;
+    size_t index;
+
+    if (aesd_lock_interruptible(dev)) {
+        return -ERESTARTSYS;
+    }
+    struct aesd_circular_buffer *buffer = aesd_buffer_locked(dev);
+    size_t count = aesd_circular_buffer_count(buffer);
+
+    snapshot = kvmalloc(struct_size(snapshot, entry, count), GFP_KERNEL);
+    if (snapshot == NULL) {
+        mutex_unlock(&dev->buffMutex);
+        return -ENOMEM;
+    }
+    snapshot->range.oldest = aesd_circular_buffer_oldest_seq(buffer);
+    snapshot->range.next = buffer->next_seq;
+    snapshot->size = 0;
+    snapshot->count = 0;
+    for (index = 0; index < count; index++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, index);
+        struct aesd_buffer_entry *pinned = &snapshot->entry[index];
+
+        if (aesd_entry_pin(dev, entry, pinned)) {
+            mutex_unlock(&dev->buffMutex);
+            aesd_snapshot_free(snapshot);
+            return -ENOMEM;
+        }
+        pinned->start_offs = snapshot->size;
+        snapshot->size += entry->size;
+        snapshot->count++;
+    }
+    mutex_unlock(&dev->buffMutex);
+
+    *snapshotRtn = snapshot;
+    return 0;
+}
+
+//@return the index of the command of @param snapshot holding byte @param pos, below snapshot->size
+static size_t aesd_snapshot_find(const struct aesd_snapshot *snapshot, size_t pos)
+{
+    size_t low = 0;
+    size_t high = snapshot->count - 1;
+
+    //Binary search for the last command starting at or before pos
+    while (low < high) {
+        size_t mid = low + (high - low + 1) / 2;
+        if (snapshot->entry[mid].start_offs <= pos) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+/**
+ * Finds the file position of byte @param offset of command @param index of @param snapshot, like
+ * aesd_circular_buffer_fpos_for_entry() does for the buffer
+ * @return 0, or -EINVAL if there is no such byte
+ */
+static int aesd_snapshot_fpos(const struct aesd_snapshot *snapshot, size_t index, size_t offset, size_t *fposRtn)
+{
+    if (index >= snapshot->count || offset >= snapshot->entry[index].size) {
+        return -EINVAL;
+    }
+    *fposRtn = snapshot->entry[index].start_offs + offset;
+    return 0;
+}
+
+/**
+ * Read of a file with a snapshot: copies from the commands it pins, starting at the file position.
+ * Must be called with the file's readMutex held.
+ * @return bytes read, 0 at the end of the snapshot, -EFAULT or -ENOMEM
+ */
+static ssize_t aesd_snapshot_read(struct aesd_file *file, struct kiocb *iocb, struct iov_iter *to)
+{
+    struct aesd_snapshot *snapshot = file->snapshot;
+    size_t count = iov_iter_count(to);
+    size_t copied = 0;
+
+    while (copied < count && iocb->ki_pos < (loff_t)snapshot->size) {
+        struct aesd_buffer_entry *entry = &snapshot->entry[aesd_snapshot_find(snapshot, iocb->ki_pos)];
+        size_t entryOffset = iocb->ki_pos - entry->start_offs;
+        const char *bytes = aesd_entry_bytes(file->dev, entry, &file->unpack);
+        if (bytes == NULL) {
+            return copied ? copied : -ENOMEM;
+        }
+        size_t bytesToCopy = min(count - copied, entry->size - entryOffset);
+        size_t delivered = copy_to_iter(bytes + entryOffset, bytesToCopy, to);
+        copied += delivered;
+        iocb->ki_pos += delivered;
+        if (delivered != bytesToCopy) {
+            return copied ? copied : -EFAULT;
+        }
+    }
+    return copied;
 }
 
 
@@ -52,153 +1202,350 @@ int aesd_open(struct inode *inode, struct file *filp)
 
     //Reference: Added cast to line below while debugging with Copilot AI
     dev = (struct aesd_dev *)container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = dev;
+
+    struct aesd_file *file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (file == NULL) {
+        return -ENOMEM;
+    }
+    file->dev = dev;
+    INIT_LIST_HEAD(&file->stage.chunks);
+    mutex_init(&file->writeMutex);
+    mutex_init(&file->readMutex);
+    filp->private_data = file;
 
     PDEBUG("Finished aesd_open()\n");
 
-    if (!bufferCleared) {
-        clear_circular_buffer();
-        bufferCleared = true;
+    aesd_lock(dev);
+    if (!dev->bufferCleared) {
+        write_seqcount_begin(&dev->seq);
+        clear_circular_buffer(dev);
+        write_seqcount_end(&dev->seq);
+        dev->bufferCleared = true;
+    }
+    //Continue a command an earlier writer left without its '\n'. Only a pure writer or appender takes it,
+    //a reader-writer opening for its own exchange should not start with someone else's bytes.
+    if ((filp->f_mode & FMODE_WRITE) && (!(filp->f_mode & FMODE_READ) || (filp->f_flags & O_APPEND))) {
+        aesd_stage_move(&dev->stage, &file->stage);
     }
+    mutex_unlock(&dev->buffMutex);
     
 
     return 0; //Success
 }
 
+/**
+ * Readable when a read at the file position would return data. Always writable, a full buffer
+ * evicts its oldest commands instead of blocking writers.
+ */
+__poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    struct aesd_file *file = (struct aesd_file*)filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &dev->readQueue, wait);
+    //A consumer reads from the oldest command, wherever the file position is. Reads of a snapshot never wait.
+    if ((!file->consume && READ_ONCE(file->snapshot)) || aesd_data_after(dev, file->consume ? 0 : filp->f_pos)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    return mask;
+}
+
+//Adds or removes @param filp from the files sent SIGIO when a command is stored
+int aesd_fasync(int fd, struct file *filp, int on)
+{
+    struct aesd_dev *dev = ((struct aesd_file*)filp->private_data)->dev;
+
+    return fasync_helper(fd, filp, on, &dev->asyncQueue);
+}
+
 int aesd_release(struct inode *inode, struct file *filp)
 {
     PDEBUG("release");
     //Need to deallocate anything open() allocated in filp->private_data
     //If allocated in init_module, free in module_exit, not here.
-    //So just return 0 here, complete.
+    struct aesd_file *file = (struct aesd_file*)filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
+    aesd_fasync(-1, filp, 0);
+
+    //Hand an unfinished command back to the device for the next writer. Only one is kept, joining two
+    //writers' partial commands would mix them into one, so a second one is dropped.
+    if (file->stage.size) {
+        aesd_lock(dev);
+        if (dev->stage.size == 0) {
+            aesd_stage_move(&file->stage, &dev->stage);
+        } else {
+            PDEBUG("dropping %zu byte unfinished command, another one is already pending\n", file->stage.size);
+        }
+        mutex_unlock(&dev->buffMutex);
+    }
+    aesd_stage_free(&file->stage);
+    kvfree(file->codec.work);
+    kvfree(file->codec.raw);
+    kvfree(file->codec.packed);
+    kvfree(file->unpack.data);
+    aesd_snapshot_free(file->snapshot);
+    kfree(file);
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * Read of a file in consume mode: removes the oldest whole commands of @param file's device that fit in
+ * @param to under buffMutex, so each command goes to exactly one reader, then copies them without it so
+ * a slow faulting user buffer never holds up writers. The file position is not used. With block_reads an
+ * empty buffer waits for a command unless the read is non-blocking.
+ * Commands are already gone when the copy runs: if it faults, the whole commands delivered before are
+ * returned and the rest of those removed are lost.
+ * @return bytes read, 0 if there are no commands, -EMSGSIZE if the oldest command is larger than the read,
+ * -EAGAIN, -EFAULT, -ENOMEM or -ERESTARTSYS
+ */
+static ssize_t aesd_consume(struct aesd_file *file, struct kiocb *iocb, struct iov_iter *to)
+{
+    struct aesd_dev *dev = file->dev;
+    size_t count = iov_iter_count(to);
+    struct aesd_circular_buffer *buffer;
+    struct aesd_snapshot *taken;
+    ssize_t retval = 0;
+    size_t consumed = 0;
+    size_t numTaken = 0;
+    size_t maxSize = 0;
+    size_t index;
+
+    //readMutex guards the unpack cache used for the copy, and like a read is not held while waiting
+    for (;;) {
+        if (mutex_lock_interruptible(&file->readMutex)) {
+            return -ERESTARTSYS;
+        }
+        if (aesd_lock_interruptible(dev)) {
+            mutex_unlock(&file->readMutex);
+            return -ERESTARTSYS;
+        }
+        buffer = aesd_buffer_locked(dev);
+        if (aesd_circular_buffer_count(buffer) || !block_reads) {
+            break;
+        }
+        mutex_unlock(&dev->buffMutex);
+        mutex_unlock(&file->readMutex);
+
+        if ((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+            return -EAGAIN;
+        }
+        //Another consumer may get there first, then wait again
+        if (wait_event_interruptible(dev->readQueue, aesd_data_after(dev, 0))) {
+            return -ERESTARTSYS;
+        }
+    }
+
+    while (numTaken < aesd_circular_buffer_count(buffer)) {
+        size_t size = aesd_circular_buffer_entry_at(buffer, numTaken)->size;
+        if (size > count - consumed) {
+            break;
+        }
+        consumed += size;
+        maxSize = max(maxSize, size);
+        numTaken++;
+    }
+    if (numTaken == 0) {
+        retval = aesd_circular_buffer_count(buffer) ? -EMSGSIZE : 0;
+        goto unlock;
+    }
+
+    //Everything that can fail goes before the commands are removed, so they stay queued then
+    taken = kvmalloc(struct_size(taken, entry, numTaken), GFP_KERNEL);
+    if (taken == NULL) {
+        retval = -ENOMEM;
+        goto unlock;
+    }
+    taken->count = 0;
+    if (dev->compress && maxSize > file->unpack.cap) {
+        file->unpack.valid = false;
+        if (aesd_scratch_reserve(&file->unpack.data, &file->unpack.cap, maxSize)) {
+            aesd_snapshot_free(taken);
+            retval = -ENOMEM;
+            goto unlock;
+        }
+    }
+    for (index = 0; index < numTaken; index++) {
+        if (aesd_entry_pin(dev, aesd_circular_buffer_entry_at(buffer, index), &taken->entry[index])) {
+            aesd_snapshot_free(taken);
+            retval = -ENOMEM;
+            goto unlock;
+        }
+        taken->count++;
+    }
+
+    //Readers that are copying them retry and see them gone
+    write_seqcount_begin(&dev->seq);
+    for (index = 0; index < numTaken; index++) {
+        aesd_entry_free(dev, aesd_circular_buffer_remove_entry(buffer));
+    }
+    write_seqcount_end(&dev->seq);
+    aesd_mirror_sync(dev);
+    this_cpu_add(dev->stats->consumed, numTaken);
+    mutex_unlock(&dev->buffMutex);
+
+    consumed = 0;
+    for (index = 0; index < numTaken; index++) {
+        struct aesd_buffer_entry *entry = &taken->entry[index];
+        const char *bytes = aesd_entry_bytes(dev, entry, &file->unpack);
+        size_t delivered = bytes ? copy_to_iter(bytes, entry->size, to) : 0;
+        if (delivered != entry->size) {
+            //Only whole commands are returned
+            iov_iter_revert(to, delivered);
+            PDEBUG("consume lost %zu commands\n", numTaken - index);
+            if (consumed == 0) {
+                retval = bytes ? -EFAULT : -ENOMEM;
+            }
+            break;
+        }
+        consumed += delivered;
+    }
+    mutex_unlock(&file->readMutex);
+    aesd_snapshot_free(taken);
+    return retval ? retval : consumed;
+
+    unlock:
+        mutex_unlock(&dev->buffMutex);
+        mutex_unlock(&file->readMutex);
+        return retval;
+}
+
+//Reads and writes go through iov_iter so readv()/writev() and splice()/sendfile() work on the device
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
     ssize_t retval = 0;
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
-    PDEBUG("Starting aesd_read()\n");
+    size_t count = iov_iter_count(to);
+    PDEBUG("read %zu bytes with offset %lld",count,iocb->ki_pos);
+    PDEBUG("Starting aesd_read_iter()\n");
 
     //Casting here to avoid "dereferencing 'void*' pointer" error
-    struct aesd_dev *dev = (struct aesd_dev*)filp->private_data;
+    struct aesd_file *file = (struct aesd_file*)iocb->ki_filp->private_data;
+    struct aesd_dev *dev = file->dev;
 
-    struct aesd_buffer_entry* foundEntry;
-    size_t entryOffset; //The found char is stored at this offset after calling find_entry_offset_for_fpos
     size_t numBytesCopied = 0;
 
-    printk("Read: fpos at %lld\n", *f_pos);
+    loff_t startPos = iocb->ki_pos;
+
+    if (READ_ONCE(file->consume)) {
+        retval = aesd_consume(file, iocb, to);
+        goto done;
+    }
+
+    //The unpack cache and snapshot of the file are shared with concurrent reads of it
+    if (mutex_lock_interruptible(&file->readMutex)) {
+        return -ERESTARTSYS;
+    }
+    char *bounce = NULL;
+    if (file->snapshot) {
+        retval = aesd_snapshot_read(file, iocb, to);
+        goto out;
+    }
 
-    mutex_lock(&dev->buffMutex);
+    //Entries are copied out under RCU into this page first, copying to the iterator may fault and sleep
+    bounce = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (bounce == NULL) {
+        retval = -ENOMEM;
+        goto out;
+    }
 
     //Reference: Used Copilot AI for debugging to determine why my original code passed natively but not in QEMU.
     //Identified differences in Busybox implementation and native implementation. Used for assistance in modification 
     //of my code to now loop through all necessary entries instead of handling one buffer entry read per function call. 
+    //No device lock: readers never wait for writers or readers of other files
     while (numBytesCopied < count) {
-        foundEntry = aesd_circular_buffer_find_entry_offset_for_fpos(dev->buffer, *f_pos, &entryOffset);
-        if (!foundEntry || entryOffset >= foundEntry->size) {
+        size_t bytesToCopy = aesd_copy_lockless(dev, iocb->ki_pos, bounce, min_t(size_t, count - numBytesCopied, PAGE_SIZE),
+                    &file->cursor, &file->unpack);
+        if (bytesToCopy == 0 && file->unpack.want > file->unpack.cap) {
+            //The next command expands to more than the cache holds, grow it outside the RCU section
+            file->unpack.valid = false;
+            if (aesd_scratch_reserve(&file->unpack.data, &file->unpack.cap, file->unpack.want) == 0) {
+                continue;
+            }
+            if (numBytesCopied == 0) {
+                retval = -ENOMEM;
+                goto out;
+            }
             break;
         }
-        size_t bytesAvailable = foundEntry->size - entryOffset;
-        size_t bytesToCopy = min(count - numBytesCopied, bytesAvailable);
-        if (copy_to_user(buf + numBytesCopied, foundEntry->buffptr + entryOffset, bytesToCopy)) {
-            retval = -EFAULT;
-            goto out;
+        if (bytesToCopy == 0) {
+            //Like a pipe, only wait if nothing was read yet
+            if (numBytesCopied || !block_reads) {
+                break;
+            }
+            if ((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+                retval = -EAGAIN;
+                goto out;
+            }
+            //Sleep without readMutex so other reads and snapshot ioctls on this file aren't held up
+            mutex_unlock(&file->readMutex);
+            if (wait_event_interruptible(dev->readQueue, aesd_data_after(dev, iocb->ki_pos)) ||
+                    mutex_lock_interruptible(&file->readMutex)) {
+                kfree(bounce);
+                retval = -ERESTARTSYS;
+                goto done;
+            }
+            //AESDCHAR_IOCSNAPSHOT may have been taken meanwhile
+            if (file->snapshot) {
+                retval = aesd_snapshot_read(file, iocb, to);
+                goto out;
+            }
+            continue;
+        }
+        //Short on a bad user address, or when a splice pipe is full
+        size_t bytesDelivered = copy_to_iter(bounce, bytesToCopy, to);
+        numBytesCopied += bytesDelivered;
+        iocb->ki_pos += bytesDelivered;
+        if (bytesDelivered != bytesToCopy) {
+            if (numBytesCopied == 0) {
+                retval = -EFAULT;
+                goto out;
+            }
+            break;
         }
-        numBytesCopied += bytesToCopy;
-        *f_pos += bytesToCopy;
     }
     retval = numBytesCopied;
 
-    PDEBUG("Finished aesd_read()\n");
+    PDEBUG("Finished aesd_read_iter()\n");
 
     out:
-        mutex_unlock(&dev->buffMutex);
+        mutex_unlock(&file->readMutex);
+        kfree(bounce);
+
+    done:
+        this_cpu_inc(dev->stats->reads);
+        if (retval > 0) {
+            this_cpu_add(dev->stats->bytesRead, retval);
+        }
+        trace_aesd_read(aesd_dev_minor(dev), startPos, count, retval);
         return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
     ssize_t retval = -ENOMEM;
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
-    PDEBUG("Starting aesd_write()\n");
+    size_t count = iov_iter_count(from);
+    PDEBUG("write %zu bytes with offset %lld",count,iocb->ki_pos);
+    PDEBUG("Starting aesd_write_iter()\n");
 
     //Casting here to avoid "dereferencing 'void*' pointer" error
-    struct aesd_dev *dev = (struct aesd_dev*)filp->private_data;
-    int writeContainsNLFlag = 0;
-
-    mutex_lock(&dev->buffMutex);
-
-    if (dev->newEntryFlag) {
-        dev->tempEntry = kmalloc(sizeof(struct aesd_buffer_entry), GFP_KERNEL);
-        if (dev->tempEntry == NULL) {
-            retval = -ENOMEM;
-            goto out;
-        }
-        //Reference: Added the below 2 lines while debugging with Copilot AI to reset tempEntry.
-        dev->tempEntry->size = 0;
-        dev->tempEntry->buffptr = NULL;
+    struct aesd_file *file = (struct aesd_file*)iocb->ki_filp->private_data;
 
-        //Reset tempEntry flag
-        dev->newEntryFlag = 0;
-    }
+    //Staging only needs this file's lock, writers on other files run concurrently
+    mutex_lock(&file->writeMutex);
+    retval = aesd_write_commands(file->dev, &file->stage, file->dev->compress ? &file->codec : NULL, from);
+    PDEBUG("Staged %zu bytes\n", file->stage.size);
+    mutex_unlock(&file->writeMutex);
 
-    //Need to resize tempEntry buffptr when partial writes occur
-    char* entryAppendedPtr = krealloc(dev->tempEntry->buffptr, dev->tempEntry->size + count, GFP_KERNEL); 
-    if (entryAppendedPtr == NULL) {
-        retval = -ENOMEM;
-        goto out;
-    }
-    dev->tempEntry->buffptr = entryAppendedPtr;
-    
-    //Returns #bytes that could not be copied
-    size_t numNotCopied = 0;
-    numNotCopied = copy_from_user((void*)(dev->tempEntry->buffptr + dev->tempEntry->size), buf, count);
-    if (numNotCopied != 0) {
-        retval = -EFAULT;
-        //Not all bytes written, may retry IN USER SPACE
+    this_cpu_inc(file->dev->stats->writes);
+    if (retval > 0) {
+        this_cpu_add(file->dev->stats->bytesWritten, retval);
     }
-    else {
-        retval = count - numNotCopied;
-
-        //Then check for newline char
-        for (size_t i = dev->tempEntry->size; i < dev->tempEntry->size + count; i++) {
-            if (dev->tempEntry->buffptr[i] == '\n') {
-                writeContainsNLFlag = 1;
-            }
-        }
-    
-        dev->tempEntry->size += count;
-
-        char debugString[dev->tempEntry->size + 1];
-        memcpy(debugString, dev->tempEntry->buffptr, dev->tempEntry->size);
-        debugString[dev->tempEntry->size] = '\0';
-        PDEBUG("TempEntry contents: %s\n", debugString);
-
-        if (writeContainsNLFlag) {
-            //Add entry to the circular buffer
-            const char* overwrittenEntryBuff = aesd_circular_buffer_add_entry(dev->buffer, dev->tempEntry);
-
-            //Should free the overwritten entry 
-            if (overwrittenEntryBuff) { //Reference: Added check so kfree doesn't try to free 'NULL' when debugging with Copilot AI
-                kfree(overwrittenEntryBuff);
-            }
+    trace_aesd_write(aesd_dev_minor(file->dev), iocb->ki_pos, count, retval);
 
-            //Since tempEntry contents get copied into the circular buffer, can now free tempEntry
-            kfree(dev->tempEntry);
-            dev->newEntryFlag = 1; 
-            dev->tempEntry = NULL;
+    PDEBUG("Finished aesd_write_iter()\n");
 
-        }
-    }
-
-    PDEBUG("Finished aesd_write()\n");
-     
-    out:
-        mutex_unlock(&dev->buffMutex);
-        return retval;
+    return retval;
 }
 
 
@@ -206,10 +1553,10 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence) {
 
     //Reference: Used copilot AI for some general debugging / catching mistakes
 
-	struct aesd_dev *dev = filp->private_data;
+	struct aesd_file *file = (struct aesd_file*)filp->private_data;
+	struct aesd_dev *dev = file->dev;
 	loff_t newpos;
-
-    mutex_lock(&dev->buffMutex);
+    unsigned int seq;
 
 	switch(whence) {
 	  case 0: /* SEEK_SET */
@@ -222,33 +1569,22 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence) {
 
 	  case 2: /* SEEK_END */
 
-        //Need to obtain end pointer
-        //Should be zero-referenced
-
-
-        //Starting point at buffer->out_offs
-        size_t tempFpos = 0;
-        int entryOffset = dev->buffer->out_offs;
-        int numEntriesChecked = 0; //Want to stop if all entries have been checked
-
-        printk("Before loop of llseek");
-
-        //Stops when all entries have been checked and tempFpos contains end
-        while (numEntriesChecked < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-
-            tempFpos += dev->buffer->entry[entryOffset].size;
-
-            numEntriesChecked++;
-            entryOffset++;
-            if (entryOffset >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-                entryOffset = 0;
-            }
-
-
-            if(!dev->buffer->full && entryOffset == dev->buffer->in_offs) {
-                tempFpos += dev->buffer->entry[entryOffset].size; //***** */
-                break;
-            }
+        //The buffer keeps its total size, so the end is known without walking the entries or locking
+        size_t tempFpos;
+        if (mutex_lock_interruptible(&file->readMutex)) {
+            return -ERESTARTSYS;
+        }
+        if (file->snapshot) {
+            tempFpos = file->snapshot->size;
+            mutex_unlock(&file->readMutex);
+        } else {
+            mutex_unlock(&file->readMutex);
+            rcu_read_lock();
+            do {
+                seq = read_seqcount_begin(&dev->seq);
+                tempFpos = rcu_dereference(dev->buffer)->size;
+            } while (read_seqcount_retry(&dev->seq, seq));
+            rcu_read_unlock();
         }
 
         //tempFpos now contains the size of the circular buffer / last byte count
@@ -256,7 +1592,6 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence) {
 
         //Reference: Copilot AI for the check below - I missed originally
         if (newpos < 0 || newpos > tempFpos) {
-            mutex_unlock(&dev->buffMutex);
             return -EINVAL; //EINVAL means invalid argument
         }
 
@@ -264,23 +1599,111 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence) {
 		break;
 
 	  default: /* can't happen */
-        mutex_unlock(&dev->buffMutex);
 		return -EINVAL;
 	}
 	if (newpos < 0) {
-        mutex_unlock(&dev->buffMutex);
         return -EINVAL;
     } 
 
 
-    mutex_unlock(&dev->buffMutex);
 	filp->f_pos = newpos;
 	return newpos;
 
 }
 
 
-long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+/**
+ * Copies up to request->max_entries whole commands of @param dev, starting at request->write_cmd, to the user
+ * buffers described by @param request and fills in its num_entries and bytes. Takes buffMutex once for the
+ * whole batch, which also keeps the commands from being evicted while they are copied.
+ * @return 0, -EINVAL if write_cmd is past the newest command, -EMSGSIZE if the first command does not fit
+ * (bytes is then its size), -EFAULT or -ERESTARTSYS
+ */
+static long aesd_read_entries(struct aesd_dev *dev, struct aesd_read_entries *request)
+{
+    char __user *data = u64_to_user_ptr(request->data);
+    struct aesd_entry_info __user *info = u64_to_user_ptr(request->info);
+    long retval = 0;
+    size_t index;
+
+    request->num_entries = 0;
+    request->bytes = 0;
+
+    if (aesd_lock_interruptible(dev)) {
+        return -ERESTARTSYS;
+    }
+    struct aesd_circular_buffer *buffer = aesd_buffer_locked(dev);
+    size_t count = aesd_circular_buffer_count(buffer);
+
+    if (request->write_cmd > count) {
+        retval = -EINVAL;
+        goto out;
+    }
+    for (index = request->write_cmd; index < count && request->num_entries < request->max_entries; index++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, index);
+        struct aesd_entry_info entryInfo = {
+            .seq = aesd_circular_buffer_seq_at(buffer, index),
+            .size = entry->size,
+        };
+
+        if (entry->size > request->data_size - request->bytes) {
+            if (request->num_entries == 0) {
+                request->bytes = entry->size;
+                retval = -EMSGSIZE;
+            }
+            break;
+        }
+        const char *bytes = aesd_entry_bytes_locked(dev, entry);
+        if (bytes == NULL) {
+            retval = -ENOMEM;
+            break;
+        }
+        if (copy_to_user(data + request->bytes, bytes, entry->size) ||
+                (info && copy_to_user(&info[request->num_entries], &entryInfo, sizeof(entryInfo)))) {
+            retval = -EFAULT;
+            break;
+        }
+        request->bytes += entry->size;
+        request->num_entries++;
+    }
+
+    out:
+        mutex_unlock(&dev->buffMutex);
+        return retval;
+}
+
+/**
+ * Fills in @param info for @param dev, including the command sizes if info->sizes is set, under a single
+ * buffMutex hold so everything describes the same state.
+ * @return 0, -EFAULT or -ERESTARTSYS
+ */
+static long aesd_get_info(struct aesd_dev *dev, struct aesd_info *info)
+{
+    uint64_t __user *sizes = u64_to_user_ptr(info->sizes);
+    long retval = 0;
+
+    if (aesd_lock_interruptible(dev)) {
+        return -ERESTARTSYS;
+    }
+    struct aesd_circular_buffer *buffer = aesd_buffer_locked(dev);
+
+    aesd_fill_info(buffer, info);
+    info->num_sizes = 0;
+    if (sizes) {
+        for (; info->num_sizes < min(info->count, info->max_sizes); info->num_sizes++) {
+            uint64_t size = aesd_circular_buffer_entry_at(buffer, info->num_sizes)->size;
+            if (put_user(size, &sizes[info->num_sizes])) {
+                retval = -EFAULT;
+                break;
+            }
+        }
+    }
+    mutex_unlock(&dev->buffMutex);
+
+    return retval;
+}
+
+static long aesd_ioctl_cmd(struct file *filp, unsigned int cmd, unsigned long arg) {
 
     //Reference: Used copilot AI for some general debugging / catching mistakes
 
@@ -322,42 +1745,230 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
             uint32_t write_cmd = temp.write_cmd;
             uint32_t write_cmd_offset = temp.write_cmd_offset;
 
-            printk("Ioctl: write_cmd as %d\n", write_cmd);
-            printk("Ioctl: write_cmd_offset as %d\n", write_cmd_offset);
+            PDEBUG("Ioctl: write_cmd as %u\n", write_cmd);
+            PDEBUG("Ioctl: write_cmd_offset as %u\n", write_cmd_offset);
 
-            struct aesd_dev* dev = (struct aesd_dev*)filp->private_data;
+            struct aesd_file* seekFile = (struct aesd_file*)filp->private_data;
+            struct aesd_dev* dev = seekFile->dev;
 
             size_t tempFpos = 0;
-            int entryOffset = dev->buffer->out_offs;
-            int numEntriesChecked = 0;
+            unsigned int seq;
 
-            //Stops when tempFpos and entryOffset at the start of write_cmd
-            while (numEntriesChecked < write_cmd) {
-            
-                
-                if (entryOffset >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-                    entryOffset = 0;
-                }
+            if (mutex_lock_interruptible(&seekFile->readMutex)) {
+                return -ERESTARTSYS;
+            }
+            if (seekFile->snapshot) {
+                status = aesd_snapshot_fpos(seekFile->snapshot, write_cmd, write_cmd_offset, &tempFpos);
+                mutex_unlock(&seekFile->readMutex);
+            } else {
+                mutex_unlock(&seekFile->readMutex);
+
+                //Constant time: each entry knows its start offset relative to the oldest one. Lockless like read.
+                rcu_read_lock();
+                do {
+                    seq = read_seqcount_begin(&dev->seq);
+                    status = aesd_circular_buffer_fpos_for_entry(rcu_dereference(dev->buffer), write_cmd,
+                                write_cmd_offset, &tempFpos);
+                } while (read_seqcount_retry(&dev->seq, seq));
+                rcu_read_unlock();
+            }
+            if (status != 0) {
+                return -EINVAL;
+            }
+            filp->f_pos = tempFpos;
 
-                if(!dev->buffer->full && entryOffset == dev->buffer->in_offs) {
-                    break;
-                }
+            PDEBUG("Ioctl: f_pos updated to %lld\n", filp->f_pos);
 
-                //TempFpos acts as total size after the loop
-                tempFpos += dev->buffer->entry[entryOffset].size;
+            break;
 
-                entryOffset++;
-                numEntriesChecked++;
+        case AESDCHAR_IOCSETCAPACITY:
 
+            uint32_t capacity;
+            if (copy_from_user(&capacity, (const void __user*)arg, sizeof(capacity)) != 0) {
+                return -EFAULT;
             }
 
-            if (write_cmd_offset >= dev->buffer->entry[entryOffset].size) {
+            struct aesd_dev* capDev = ((struct aesd_file*)filp->private_data)->dev;
+
+            aesd_lock(capDev);
+            retval = aesd_buffer_resize(capDev, capacity);
+            mutex_unlock(&capDev->buffMutex);
+
+            break;
+
+        case AESDCHAR_IOCSETMAXBYTES:
+
+            uint64_t maxBytes;
+            if (copy_from_user(&maxBytes, (const void __user*)arg, sizeof(maxBytes)) != 0) {
+                return -EFAULT;
+            }
+            if (maxBytes > SIZE_MAX) {
                 return -EINVAL;
             }
-            tempFpos += write_cmd_offset;
-            filp->f_pos = tempFpos;
 
-            printk("Ioctl: f_pos updated to %lld\n", filp->f_pos);
+            struct aesd_dev* budgetDev = ((struct aesd_file*)filp->private_data)->dev;
+
+            //A lower budget takes effect right away, not on the next write
+            aesd_lock(budgetDev);
+            write_seqcount_begin(&budgetDev->seq);
+            aesd_buffer_locked(budgetDev)->max_bytes = maxBytes;
+            aesd_circular_buffer_trim(aesd_buffer_locked(budgetDev));
+            write_seqcount_end(&budgetDev->seq);
+            aesd_mirror_sync(budgetDev);
+            mutex_unlock(&budgetDev->buffMutex);
+
+            break;
+
+        case AESDCHAR_IOCSEEKSEQ:
+
+            uint64_t seekSeq;
+            if (copy_from_user(&seekSeq, (const void __user*)arg, sizeof(seekSeq)) != 0) {
+                return -EFAULT;
+            }
+
+            struct aesd_file* seqFile = (struct aesd_file*)filp->private_data;
+            struct aesd_dev* seqDev = seqFile->dev;
+            size_t seqFpos = 0;
+
+            if (mutex_lock_interruptible(&seqFile->readMutex)) {
+                return -ERESTARTSYS;
+            }
+            if (seqFile->snapshot) {
+                struct aesd_snapshot *snapshot = seqFile->snapshot;
+
+                retval = 0;
+                if (seekSeq < snapshot->range.oldest) {
+                    retval = -ERANGE;
+                } else if (seekSeq > snapshot->range.next) {
+                    retval = -EINVAL;
+                } else if (seekSeq == snapshot->range.next) {
+                    seqFpos = snapshot->size;
+                } else {
+                    retval = aesd_snapshot_fpos(snapshot, seekSeq - snapshot->range.oldest, 0, &seqFpos);
+                }
+                mutex_unlock(&seqFile->readMutex);
+            } else {
+                mutex_unlock(&seqFile->readMutex);
+
+                //Lockless like AESDCHAR_IOCSEEKTO, the entry index is just the distance from the oldest sequence number
+                rcu_read_lock();
+                do {
+                    seq = read_seqcount_begin(&seqDev->seq);
+                    struct aesd_circular_buffer *buffer = rcu_dereference(seqDev->buffer);
+                    uint64_t oldest = aesd_circular_buffer_oldest_seq(buffer);
+
+                    retval = 0;
+                    if (seekSeq < oldest) {
+                        retval = -ERANGE;
+                    } else if (seekSeq > buffer->next_seq) {
+                        retval = -EINVAL;
+                    } else if (seekSeq == buffer->next_seq) {
+                        seqFpos = buffer->size;
+                    } else if (aesd_circular_buffer_fpos_for_entry(buffer, seekSeq - oldest, 0, &seqFpos) != 0) {
+                        retval = -EINVAL;
+                    }
+                } while (read_seqcount_retry(&seqDev->seq, seq));
+                rcu_read_unlock();
+            }
+            if (retval == 0) {
+                filp->f_pos = seqFpos;
+            }
+
+            break;
+
+        case AESDCHAR_IOCGETSEQRANGE:
+
+            struct aesd_dev* rangeDev = ((struct aesd_file*)filp->private_data)->dev;
+            struct aesd_seq_range range;
+
+            rcu_read_lock();
+            do {
+                seq = read_seqcount_begin(&rangeDev->seq);
+                struct aesd_circular_buffer *buffer = rcu_dereference(rangeDev->buffer);
+                range.oldest = aesd_circular_buffer_oldest_seq(buffer);
+                range.next = buffer->next_seq;
+            } while (read_seqcount_retry(&rangeDev->seq, seq));
+            rcu_read_unlock();
+
+            if (copy_to_user((void __user*)arg, &range, sizeof(range)) != 0) {
+                return -EFAULT;
+            }
+
+            break;
+
+        case AESDCHAR_IOCREADENTRIES:
+
+            struct aesd_read_entries request;
+            if (copy_from_user(&request, (const void __user*)arg, sizeof(request)) != 0) {
+                return -EFAULT;
+            }
+
+            retval = aesd_read_entries(((struct aesd_file*)filp->private_data)->dev, &request);
+
+            //Counts are reported on success and with the needed size on EMSGSIZE
+            if ((retval == 0 || retval == -EMSGSIZE) && copy_to_user((void __user*)arg, &request, sizeof(request))) {
+                return -EFAULT;
+            }
+
+            break;
+
+        case AESDCHAR_IOCGETINFO:
+
+            struct aesd_info info;
+            if (copy_from_user(&info, (const void __user*)arg, sizeof(info)) != 0) {
+                return -EFAULT;
+            }
+
+            retval = aesd_get_info(((struct aesd_file*)filp->private_data)->dev, &info);
+            if (retval == 0 && copy_to_user((void __user*)arg, &info, sizeof(info)) != 0) {
+                return -EFAULT;
+            }
+
+            break;
+
+        case AESDCHAR_IOCSNAPSHOT:
+
+            struct aesd_file *snapFile = (struct aesd_file*)filp->private_data;
+            struct aesd_snapshot *snapshot;
+
+            retval = aesd_snapshot_take(snapFile->dev, &snapshot);
+            if (retval) {
+                return retval;
+            }
+            if (copy_to_user((void __user*)arg, &snapshot->range, sizeof(snapshot->range)) != 0) {
+                aesd_snapshot_free(snapshot);
+                return -EFAULT;
+            }
+
+            //Replaces any earlier snapshot of the file, freed once no read is using it
+            mutex_lock(&snapFile->readMutex);
+            struct aesd_snapshot *replaced = snapFile->snapshot;
+            snapFile->snapshot = snapshot;
+            filp->f_pos = 0;
+            mutex_unlock(&snapFile->readMutex);
+            aesd_snapshot_free(replaced);
+
+            break;
+
+        case AESDCHAR_IOCDROPSNAPSHOT:
+
+            struct aesd_file *dropFile = (struct aesd_file*)filp->private_data;
+
+            mutex_lock(&dropFile->readMutex);
+            struct aesd_snapshot *dropped = dropFile->snapshot;
+            dropFile->snapshot = NULL;
+            mutex_unlock(&dropFile->readMutex);
+            aesd_snapshot_free(dropped);
+
+            break;
+
+        case AESDCHAR_IOCCONSUME:
+
+            uint32_t consume;
+            if (copy_from_user(&consume, (const void __user*)arg, sizeof(consume)) != 0) {
+                return -EFAULT;
+            }
+            WRITE_ONCE(((struct aesd_file*)filp->private_data)->consume, consume != 0);
 
             break;
 
@@ -368,19 +1979,68 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     return retval;
 }
 
+long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    long retval = aesd_ioctl_cmd(filp, cmd, arg);
+
+    trace_aesd_ioctl(aesd_dev_minor(((struct aesd_file*)filp->private_data)->dev), cmd, retval);
+    return retval;
+}
+
+/**
+ * Maps the read-only mirror of the stored commands (struct aesd_mmap_header in aesd_ioctl.h),
+ * creating it on the first call. Pages stay owned by the driver and are never writable.
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = ((struct aesd_file*)filp->private_data)->dev;
+    int result = 0;
+
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+
+    aesd_lock(dev);
+    if (dev->mirror == NULL) {
+        result = aesd_mirror_create(dev);
+    }
+    mutex_unlock(&dev->buffMutex);
+    if (result) {
+        return result;
+    }
+
+    //No mprotect() to writable later. vm_flags is read-only since 6.3, changes go through the helpers.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, dev->mirror, vma->vm_pgoff);
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
     .llseek =   aesd_llseek,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter =    aesd_read_iter,
+    .write_iter =   aesd_write_iter,
+    //generic_file_splice_read() is gone since 6.5, copy_splice_read() goes through read_iter the same way
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read =  copy_splice_read,
+#else
+    .splice_read =  generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
+    .fasync =   aesd_fasync,
     .open =     aesd_open,
     .release =  aesd_release,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
@@ -393,68 +2053,153 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
 }
 
 
+/**
+ * Sets up the buffer, lock and char device of @param dev, minor number @param index
+ * @return 0, or a negative error with nothing left to clean up
+ */
+static int aesd_dev_init(struct aesd_dev *dev, unsigned int index)
+{
+    int result;
+
+    mutex_init(&dev->buffMutex);
+    seqcount_mutex_init(&dev->seq, &dev->buffMutex);
+    init_waitqueue_head(&dev->readQueue);
+    INIT_LIST_HEAD(&dev->stage.chunks);
+    dev->compress = compress;
+
+    struct aesd_circular_buffer *buffer = kmalloc(sizeof(struct aesd_circular_buffer), GFP_KERNEL);
+    if (buffer == NULL) {
+        return -ENOMEM;
+    }
+
+    //Reference: Originally forgot to include the line below, caught while debugging with Copilot AI.
+    aesd_circular_buffer_init(buffer);
+
+    //Evicted entries are freed by the callback, by count or by byte budget
+    buffer->evict = aesd_evict_entry;
+    buffer->max_bytes = max_bytes;
+    RCU_INIT_POINTER(dev->buffer, buffer);
+
+    if (ring_bytes) {
+        dev->ring.data = vmalloc(ring_bytes);
+        if (dev->ring.data == NULL) {
+            kfree(buffer);
+            return -ENOMEM;
+        }
+        dev->ring.bytes = ring_bytes;
+        buffer->evict = aesd_evict_ring_entry;
+    }
+
+    if (buffer_entries != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        mutex_lock(&dev->buffMutex);
+        result = aesd_buffer_resize(dev, buffer_entries);
+        mutex_unlock(&dev->buffMutex);
+        if (result) {
+            printk(KERN_WARNING "Invalid buffer_entries %u\n", buffer_entries);
+            kfree(buffer);
+            vfree(dev->ring.data);
+            return result;
+        }
+    }
+
+    dev->stats = alloc_percpu(struct aesd_stats);
+    result = dev->stats ? aesd_setup_cdev(dev, index) : -ENOMEM;
+    if (result) {
+        free_percpu(dev->stats);
+        aesd_buffer_free(dev);
+        vfree(dev->ring.data);
+    }
+    return result;
+}
+
+//Removes the char device of @param dev and frees everything it stores, no readers are left
+static void aesd_dev_cleanup(struct aesd_dev *dev)
+{
+    cdev_del(&dev->cdev);
+
+    aesd_buffer_free(dev);
+    vfree(dev->ring.data);
+
+    //Drop any command that was never completed with a newline
+    aesd_stage_free(&dev->stage);
+
+    //No mapping is left once the last file is closed
+    vfree(dev->mirror);
+    free_percpu(dev->stats);
+    kvfree(dev->unpack.data);
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    unsigned int index;
+
+    if (devices == 0 || devices > AESD_MAX_DEVICES) {
+        printk(KERN_WARNING "Invalid devices %u\n", devices);
+        return -EINVAL;
+    }
+    if (compress && (!AESD_LZ4_AVAILABLE || ring_bytes)) {
+        printk(KERN_WARNING "compress needs CONFIG_LZ4_COMPRESS and CONFIG_LZ4_DECOMPRESS, and no ring_bytes\n");
+        return -EINVAL;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, devices,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-
-    aesd_device.buffer = kmalloc(sizeof(struct aesd_circular_buffer), GFP_KERNEL);
-    if (aesd_device.buffer == NULL) {
-        result = -ENOMEM;
-        goto out;
+    aesd_devices = kcalloc(devices, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (aesd_devices == NULL) {
+        unregister_chrdev_region(dev, devices);
+        return -ENOMEM;
     }
 
-    //Reference: Originally forgot to include the line below, caught while debugging with Copilot AI.
-    aesd_circular_buffer_init(aesd_device.buffer);
-
-    //Set to 1 so the first write starts with the newEntryFlag correctly
-    aesd_device.newEntryFlag = 1; 
-    aesd_device.tempEntry = NULL;
-
-    mutex_init(&aesd_device.buffMutex);
-
-    result = aesd_setup_cdev(&aesd_device);
+    for (index = 0; index < devices; index++) {
+        result = aesd_dev_init(&aesd_devices[index], index);
+        if (result) {
+            while (index--) {
+                aesd_dev_cleanup(&aesd_devices[index]);
+            }
+            kfree(aesd_devices);
+            unregister_chrdev_region(dev, devices);
+            return result;
+        }
+    }
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+    if (!proc_create_single("aesdchar", 0444, NULL, aesd_proc_show)) {
+        //Counters are optional, the devices work without them
+        printk(KERN_WARNING "Can't create /proc/aesdchar\n");
     }
 
-    PDEBUG("Finished aesd_init_module()\n");
+    //Same for the stats, debugfs errors need no checking
+    aesd_debugfs_dir = debugfs_create_dir("aesdchar", NULL);
+    debugfs_create_file("stats", 0444, aesd_debugfs_dir, NULL, &aesd_stats_fops);
 
-    out:
-        return result;
+    PDEBUG("Finished aesd_init_module()\n");
 
+    return result;
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    unsigned int index;
 
-    cdev_del(&aesd_device.cdev);
-
-    //Need to kfree all entries in the circular buffer
-    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-        kfree(aesd_device.buffer->entry[i].buffptr);
-    }
-
-    kfree(aesd_device.buffer);
+    remove_proc_entry("aesdchar", NULL);
+    debugfs_remove_recursive(aesd_debugfs_dir);
 
-    if (aesd_device.tempEntry) {
-        kfree(aesd_device.tempEntry);
+    for (index = 0; index < devices; index++) {
+        aesd_dev_cleanup(&aesd_devices[index]);
     }
+    kfree(aesd_devices);
 
     PDEBUG("Finished aesd_cleanup_module()\n");
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, devices);
 }
 
 
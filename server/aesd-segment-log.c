@@ -0,0 +1,1288 @@
+/**
+ * @file aesd-segment-log.c
+ * @brief Segmented append-only log used as the aesdsocket file backend
+ *
+ * Any necessary locking must be performed by the caller, aesdsocket uses its fileMutex.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "aesd-segment-log.h"
+
+#define CHECKPOINT_MAGIC 0x41455344 //"AESD"
+#define CHECKPOINT_VERSION 1
+
+/**
+ * Layout of the checkpoint file: this header, num_segments checkpoint_segment entries,
+ * then num_times aesd_time_entry-like checkpoint_time entries
+ */
+struct checkpoint_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t end_offset;
+    uint64_t end_record;
+    uint64_t num_segments;
+    uint64_t num_times;
+};
+
+struct checkpoint_segment
+{
+    uint64_t base_offset;
+    uint64_t base_record;
+    uint64_t size;
+    uint64_t num_records;
+    int64_t mtime;
+};
+
+struct checkpoint_time
+{
+    int64_t time;
+    uint64_t offset;
+};
+
+static void segment_path(const struct aesd_segment_log *log, unsigned long long base_offset,
+            const char *ext, char *path, size_t path_len)
+{
+    snprintf(path, path_len, "%s/%020llu.%s", log->dir, base_offset, ext);
+}
+
+//write() everything or fail, short writes on a regular file only happen when the disk fills
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static int segment_add_index(struct aesd_segment *seg, unsigned long long record, size_t position)
+{
+    if (seg->index_len == seg->index_cap) {
+        size_t newCap = seg->index_cap ? seg->index_cap * 2 : 16;
+        struct aesd_index_entry *newIndex = realloc(seg->index, newCap * sizeof(*newIndex));
+        if (!newIndex) {
+            return -1;
+        }
+        seg->index = newIndex;
+        seg->index_cap = newCap;
+    }
+
+    struct aesd_index_entry *entry = &seg->index[seg->index_len++];
+    entry->record = record;
+    entry->position = position;
+
+    //The on-disk copy is only a hint for later, a failed write just makes seeks scan further
+    if (seg->index_fd != -1 && write_all(seg->index_fd, (const char *)entry, sizeof(*entry)) != 0) {
+        syslog(LOG_ERR, "Failed to write sparse index entry: %s\n", strerror(errno));
+    }
+    return 0;
+}
+
+//Adds the start offset of @param record to the dense line index, restarting it if record doesn't follow on
+static int line_index_push(struct aesd_line_index *lines, unsigned long long record, unsigned long long offset)
+{
+    if (lines->len > 0 && lines->first_record + lines->len != record) {
+        lines->len = 0;
+    }
+    if (lines->len == 0) {
+        lines->first_record = record;
+        lines->head = 0;
+    }
+    if (lines->head + lines->len == lines->cap) {
+        size_t newCap = lines->cap ? lines->cap * 2 : 256;
+        unsigned long long *newOffsets = realloc(lines->offsets, newCap * sizeof(*newOffsets));
+        if (!newOffsets) {
+            return -1;
+        }
+        lines->offsets = newOffsets;
+        lines->cap = newCap;
+    }
+    lines->offsets[lines->head + lines->len++] = offset;
+    return 0;
+}
+
+//Appends the start offset of a new record to the dense line index (and its .lines file if persisted)
+static int line_index_add(struct aesd_segment_log *log, struct aesd_segment *seg, unsigned long long offset)
+{
+    if (line_index_push(&log->lines, log->end_record, offset) != 0) {
+        return -1;
+    }
+
+    if (seg->lines_fd != -1) {
+        uint64_t diskOffset = offset;
+        if (write_all(seg->lines_fd, (const char *)&diskOffset, sizeof(diskOffset)) != 0) {
+            syslog(LOG_ERR, "Failed to write line index entry: %s\n", strerror(errno));
+        }
+    }
+    return 0;
+}
+
+//Forgets records dropped by retention, compacting once the dead prefix outgrows the live part
+static void line_index_trim(struct aesd_segment_log *log)
+{
+    struct aesd_line_index *lines = &log->lines;
+    unsigned long long startRecord = aesd_log_start_record(log);
+
+    if (lines->len == 0 || startRecord <= lines->first_record) {
+        return;
+    }
+
+    size_t numDropped = startRecord - lines->first_record;
+    if (numDropped > lines->len) {
+        numDropped = lines->len;
+    }
+    lines->head += numDropped;
+    lines->len -= numDropped;
+    lines->first_record += numDropped;
+
+    if (lines->head > lines->len) {
+        memmove(lines->offsets, lines->offsets + lines->head, lines->len * sizeof(*lines->offsets));
+        lines->head = 0;
+    }
+}
+
+//Drops time index entries pointing before the oldest retained byte
+static void time_index_trim(struct aesd_segment_log *log)
+{
+    struct aesd_time_index *times = &log->times;
+    unsigned long long startOffset = aesd_log_start_offset(log);
+
+    while (times->len > 0 && times->entries[times->head].offset < startOffset) {
+        times->head++;
+        times->len--;
+    }
+    if (times->head > times->len) {
+        memmove(times->entries, times->entries + times->head, times->len * sizeof(*times->entries));
+        times->head = 0;
+    }
+}
+
+static void segment_close(struct aesd_segment_log *log, struct aesd_segment *seg, bool remove_files)
+{
+    char path[300];
+
+    if (seg->fd != -1) {
+        close(seg->fd);
+    }
+    if (seg->index_fd != -1) {
+        close(seg->index_fd);
+    }
+    if (seg->lines_fd != -1) {
+        close(seg->lines_fd);
+    }
+    free(seg->index);
+
+    if (remove_files) {
+        segment_path(log, seg->base_offset, "log", path, sizeof(path));
+        unlink(path);
+        segment_path(log, seg->base_offset, "index", path, sizeof(path));
+        unlink(path);
+        segment_path(log, seg->base_offset, "lines", path, sizeof(path));
+        unlink(path);
+    }
+}
+
+//Makes room for one more segment at the end of @param log, not counted in num_segments yet
+static struct aesd_segment *segment_alloc(struct aesd_segment_log *log)
+{
+    if (log->num_segments == log->segments_cap) {
+        size_t newCap = log->segments_cap ? log->segments_cap * 2 : 8;
+        struct aesd_segment *newSegments = realloc(log->segments, newCap * sizeof(*newSegments));
+        if (!newSegments) {
+            return NULL;
+        }
+        log->segments = newSegments;
+        log->segments_cap = newCap;
+    }
+
+    struct aesd_segment *seg = &log->segments[log->num_segments];
+    memset(seg, 0, sizeof(*seg));
+    seg->base_offset = log->end_offset;
+    seg->base_record = log->end_record;
+    seg->fd = -1;
+    seg->index_fd = -1;
+    seg->lines_fd = -1;
+    return seg;
+}
+
+/**
+ * Creates an empty segment starting at the current end of @param log and makes it the active one.
+ * @return the new segment, or NULL on failure
+ */
+static struct aesd_segment *segment_create(struct aesd_segment_log *log)
+{
+    char path[300];
+
+    struct aesd_segment *seg = segment_alloc(log);
+    if (!seg) {
+        return NULL;
+    }
+    seg->mtime = time(NULL);
+
+    segment_path(log, seg->base_offset, "log", path, sizeof(path));
+    seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (seg->fd == -1) {
+        syslog(LOG_ERR, "Failed to create segment %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    segment_path(log, seg->base_offset, "index", path, sizeof(path));
+    seg->index_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (seg->index_fd == -1) {
+        syslog(LOG_ERR, "Failed to create index %s: %s\n", path, strerror(errno));
+    }
+
+    if (log->config.persist_line_index) {
+        segment_path(log, seg->base_offset, "lines", path, sizeof(path));
+        seg->lines_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (seg->lines_fd == -1) {
+            syslog(LOG_ERR, "Failed to create line index %s: %s\n", path, strerror(errno));
+        }
+    }
+
+    log->num_segments++;
+    return seg;
+}
+
+//Deletes any *.log / *.index / *.lines files and the checkpoint left behind in dir by an earlier run
+static void remove_stale_segments(const char *dir)
+{
+    DIR *dirp = opendir(dir);
+    if (!dirp) {
+        return;
+    }
+
+    struct dirent *dent;
+    char path[300];
+    while ((dent = readdir(dirp)) != NULL) {
+        const char *ext = strrchr(dent->d_name, '.');
+        if (ext && (!strcmp(ext, ".log") || !strcmp(ext, ".index") || !strcmp(ext, ".lines"))) {
+            snprintf(path, sizeof(path), "%s/%s", dir, dent->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dirp);
+
+    snprintf(path, sizeof(path), "%s/checkpoint", dir);
+    unlink(path);
+}
+
+/**
+ * Opens an empty log in directory @param dir, creating it if needed and deleting segments from earlier runs.
+ * @param config segment size and retention limits, copied into @param log
+ * @return 0 on success, -1 on failure with errno set
+ */
+int aesd_log_open(struct aesd_segment_log *log, const char *dir, const struct aesd_log_config *config)
+{
+    memset(log, 0, sizeof(*log));
+    snprintf(log->dir, sizeof(log->dir), "%s", dir);
+    log->config = *config;
+    if (log->config.segment_bytes == 0) {
+        log->config.segment_bytes = AESD_LOG_DEFAULT_SEGMENT_BYTES;
+    }
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    remove_stale_segments(dir);
+
+    if (!segment_create(log)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Accounts for @param len bytes of @param buf just stored at the end of @param seg: counts the records
+ * starting in them, adds them to the dense line index and keeps the sparse index at most one interval apart.
+ */
+static void index_records(struct aesd_segment_log *log, struct aesd_segment *seg, const char *buf, size_t len)
+{
+    size_t position = seg->size;
+    const char *recordStart = log->partial_record ? NULL : buf;
+    const char *end = buf + len;
+    while (true) {
+        if (recordStart) {
+            size_t recordPos = position + (recordStart - buf);
+            if (seg->index_len == 0 ||
+                    recordPos - seg->index[seg->index_len - 1].position >= AESD_LOG_INDEX_INTERVAL_BYTES) {
+                segment_add_index(seg, log->end_record, recordPos);
+            }
+            if (line_index_add(log, seg, seg->base_offset + recordPos) != 0) {
+                syslog(LOG_ERR, "Out of memory for the line index\n");
+            }
+            seg->num_records++;
+            log->end_record++;
+        }
+
+        const char *scanFrom = recordStart ? recordStart : buf;
+        const char *newline = memchr(scanFrom, '\n', end - scanFrom);
+        if (!newline || newline + 1 == end) {
+            break;
+        }
+        recordStart = newline + 1;
+    }
+
+    seg->size += len;
+    log->end_offset += len;
+    log->partial_record = buf[len - 1] != '\n';
+}
+
+/**
+ * Appends @param len bytes of @param buf to the active segment, rolling over to a new segment first
+ * when it would grow past segment_bytes. Records never span segments, so a continuation of a partial
+ * record always stays in the active segment even if that makes it oversized.
+ * @return len on success, -1 on failure
+ */
+ssize_t aesd_log_append(struct aesd_segment_log *log, const char *buf, size_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+
+    struct aesd_segment *seg = &log->segments[log->num_segments - 1];
+    if (seg->size > 0 && !log->partial_record && seg->size + len > log->config.segment_bytes) {
+        seg = segment_create(log);
+        if (!seg) {
+            return -1;
+        }
+    }
+
+    if (write_all(seg->fd, buf, len) != 0) {
+        syslog(LOG_ERR, "Failed to append to segment %020llu: %s\n", seg->base_offset, strerror(errno));
+        return -1;
+    }
+
+    index_records(log, seg, buf, len);
+    seg->mtime = time(NULL);
+    seg->writes++;
+    if (log->first_dirty > log->num_segments - 1) {
+        log->first_dirty = log->num_segments - 1;
+    }
+
+    aesd_log_apply_retention(log);
+    return len;
+}
+
+/**
+ * Same as aesd_log_append(), and also records @param when in the time index for the start of buf.
+ * Times are kept non-decreasing so the index stays binary searchable if the wall clock steps back.
+ * @return len on success, -1 on failure
+ */
+ssize_t aesd_log_append_timed(struct aesd_segment_log *log, const char *buf, size_t len, time_t when)
+{
+    struct aesd_time_index *times = &log->times;
+    unsigned long long recordOffset = log->end_offset;
+
+    ssize_t retval = aesd_log_append(log, buf, len);
+    if (retval <= 0) {
+        return retval;
+    }
+
+    if (times->len == 0) {
+        times->head = 0;
+    }
+    if (times->head + times->len == times->cap) {
+        size_t newCap = times->cap ? times->cap * 2 : 64;
+        struct aesd_time_entry *newEntries = realloc(times->entries, newCap * sizeof(*newEntries));
+        if (!newEntries) {
+            syslog(LOG_ERR, "Out of memory for the time index\n");
+            return retval;
+        }
+        times->entries = newEntries;
+        times->cap = newCap;
+    }
+    if (times->len > 0 && when < times->entries[times->head + times->len - 1].time) {
+        when = times->entries[times->head + times->len - 1].time;
+    }
+
+    struct aesd_time_entry *entry = &times->entries[times->head + times->len++];
+    entry->time = when;
+    entry->offset = recordOffset;
+    return retval;
+}
+
+//@return index of the last segment whose base_offset is <= offset
+static size_t find_segment_for_offset(const struct aesd_segment_log *log, unsigned long long offset)
+{
+    size_t lo = 0, hi = log->num_segments;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (log->segments[mid].base_offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Reads up to @param len bytes starting at logical @param offset. Only the segment holding offset
+ * is touched, so the result may be shorter than len at a segment boundary; callers loop.
+ * @return bytes read, 0 at the end of the log or before its start, -1 on read error
+ */
+ssize_t aesd_log_read(struct aesd_segment_log *log, unsigned long long offset, char *buf, size_t len)
+{
+    if (offset < aesd_log_start_offset(log) || offset >= log->end_offset) {
+        return 0;
+    }
+
+    struct aesd_segment *seg = &log->segments[find_segment_for_offset(log, offset)];
+    size_t position = offset - seg->base_offset;
+    size_t available = seg->size - position;
+    if (len > available) {
+        len = available;
+    }
+
+    ssize_t numRead;
+    do {
+        numRead = pread(seg->fd, buf, len, position);
+    } while (numRead == -1 && errno == EINTR);
+    return numRead;
+}
+
+/**
+ * Finds the logical offset where absolute record number @param record starts, using the segment
+ * list and that segment's sparse index, then scanning at most about one index interval.
+ * @param offset_rtn set to the record's offset on success
+ * @return 0 on success, -1 if the record is no longer retained or not written yet
+ */
+int aesd_log_find_record(struct aesd_segment_log *log, unsigned long long record,
+            unsigned long long *offset_rtn)
+{
+    if (record < aesd_log_start_record(log) || record >= log->end_record) {
+        return -1;
+    }
+
+    //Last segment whose first record is <= record
+    size_t lo = 0, hi = log->num_segments;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (log->segments[mid].base_record <= record) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    struct aesd_segment *seg = &log->segments[lo];
+
+    //Last sparse index entry whose record is <= record
+    unsigned long long currRecord = seg->base_record;
+    size_t position = 0;
+    if (seg->index_len > 0 && seg->index[0].record <= record) {
+        size_t ilo = 0, ihi = seg->index_len;
+        while (ihi - ilo > 1) {
+            size_t mid = ilo + (ihi - ilo) / 2;
+            if (seg->index[mid].record <= record) {
+                ilo = mid;
+            } else {
+                ihi = mid;
+            }
+        }
+        currRecord = seg->index[ilo].record;
+        position = seg->index[ilo].position;
+    }
+
+    char scanBuf[1024];
+    while (currRecord < record) {
+        ssize_t numRead = pread(seg->fd, scanBuf, sizeof(scanBuf), position);
+        if (numRead <= 0) {
+            return -1;
+        }
+
+        const char *scanPos = scanBuf;
+        const char *end = scanBuf + numRead;
+        const char *newline;
+        while (currRecord < record && (newline = memchr(scanPos, '\n', end - scanPos)) != NULL) {
+            currRecord++;
+            scanPos = newline + 1;
+        }
+        //Either stopped right at the record or used up the whole chunk
+        position += (currRecord == record) ? (size_t)(scanPos - scanBuf) : (size_t)numRead;
+    }
+
+    *offset_rtn = seg->base_offset + position;
+    return 0;
+}
+
+/**
+ * O(1) lookup of where absolute record number @param record starts, from the dense line index.
+ * Falls back to aesd_log_find_record() if the record is missing from it (e.g. after running out of memory).
+ * @param offset_rtn set to the record's logical start offset
+ * @param size_rtn set to the record's length in bytes, including its '\n'
+ * @return 0 on success, -1 if the record is no longer retained or not written yet
+ */
+int aesd_log_record_offset(struct aesd_segment_log *log, unsigned long long record,
+            unsigned long long *offset_rtn, unsigned long long *size_rtn)
+{
+    struct aesd_line_index *lines = &log->lines;
+
+    if (record < aesd_log_start_record(log) || record >= log->end_record) {
+        return -1;
+    }
+
+    unsigned long long nextOffset;
+    if (lines->len == log->end_record - lines->first_record && record >= lines->first_record) {
+        size_t i = lines->head + (record - lines->first_record);
+        *offset_rtn = lines->offsets[i];
+        nextOffset = (record + 1 < log->end_record) ? lines->offsets[i + 1] : log->end_offset;
+    } else {
+        if (aesd_log_find_record(log, record, offset_rtn) != 0) {
+            return -1;
+        }
+        if (record + 1 >= log->end_record) {
+            nextOffset = log->end_offset;
+        } else if (aesd_log_find_record(log, record + 1, &nextOffset) != 0) {
+            return -1;
+        }
+    }
+
+    *size_rtn = nextOffset - *offset_rtn;
+    return 0;
+}
+
+/**
+ * Binary searches the time index for the first record appended at or after @param since.
+ * Only records appended with aesd_log_append_timed() are indexed, anything between two indexed
+ * records is attributed to the later one.
+ * @param offset_rtn set to that record's logical offset
+ * @return 0 on success, -1 if nothing indexed is that recent
+ */
+int aesd_log_find_time(struct aesd_segment_log *log, time_t since, unsigned long long *offset_rtn)
+{
+    struct aesd_time_index *times = &log->times;
+    struct aesd_time_entry *first = times->entries + times->head;
+
+    size_t lo = 0, hi = times->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (first[mid].time < since) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == times->len) {
+        return -1;
+    }
+
+    *offset_rtn = first[lo].offset;
+    return 0;
+}
+
+//Moves first_dirty past the segments that have nothing left to sync
+static void skip_clean_segments(struct aesd_segment_log *log)
+{
+    while (log->first_dirty < log->num_segments &&
+            log->segments[log->first_dirty].writes == log->segments[log->first_dirty].synced_writes) {
+        log->first_dirty++;
+    }
+}
+
+/**
+ * Hands out dup()ed fds for every segment written since its last successful sync, so the caller can
+ * aesd_log_sync_dirty() them without holding its lock, then hands them back to aesd_log_release_dirty().
+ * Segments stay dirty unless their sync succeeded.
+ * @return number of entries stored in a malloc()ed array at @param dirty_rtn, or -1 on failure
+ */
+int aesd_log_dup_dirty(struct aesd_segment_log *log, struct aesd_dirty_segment **dirty_rtn)
+{
+    struct aesd_dirty_segment *dirty = NULL;
+    int numDirty = 0;
+
+    *dirty_rtn = NULL;
+    skip_clean_segments(log);
+    for (size_t i = log->first_dirty; i < log->num_segments; i++) {
+        struct aesd_segment *seg = &log->segments[i];
+        if (seg->writes == seg->synced_writes) {
+            continue;
+        }
+        if (!dirty) {
+            dirty = malloc((log->num_segments - i) * sizeof(*dirty));
+            if (!dirty) {
+                return -1;
+            }
+        }
+        int fd = dup(seg->fd);
+        int linesFd = seg->lines_fd == -1 ? -1 : dup(seg->lines_fd);
+        if (fd == -1 || (seg->lines_fd != -1 && linesFd == -1)) {
+            syslog(LOG_ERR, "Failed to dup segment %020llu: %s\n", seg->base_offset, strerror(errno));
+            if (fd != -1) {
+                close(fd);
+            }
+            aesd_log_release_dirty(log, dirty, numDirty);
+            return -1;
+        }
+        dirty[numDirty].fd = fd;
+        dirty[numDirty].lines_fd = linesFd;
+        dirty[numDirty].base_offset = seg->base_offset;
+        dirty[numDirty].writes = seg->writes;
+        dirty[numDirty].synced = false;
+        numDirty++;
+    }
+    *dirty_rtn = dirty;
+    return numDirty;
+}
+
+//Records that the sync of @param dirty succeeded, appends made since aesd_log_dup_dirty() keep it dirty
+static void mark_synced(struct aesd_segment_log *log, const struct aesd_dirty_segment *dirty)
+{
+    for (size_t i = log->first_dirty; i < log->num_segments; i++) {
+        struct aesd_segment *seg = &log->segments[i];
+        if (seg->base_offset == dirty->base_offset) {
+            if (seg->synced_writes < dirty->writes) {
+                seg->synced_writes = dirty->writes;
+            }
+            break;
+        }
+    }
+    skip_clean_segments(log);
+}
+
+/**
+ * fdatasync()s a segment handed out by aesd_log_dup_dirty() and its .lines file, needs no lock
+ * @return 0 and sets dirty->synced on success, -1 with errno set on failure
+ */
+int aesd_log_sync_dirty(struct aesd_dirty_segment *dirty)
+{
+    if (fdatasync(dirty->fd) != 0 || (dirty->lines_fd != -1 && fdatasync(dirty->lines_fd) != 0)) {
+        return -1;
+    }
+    dirty->synced = true;
+    return 0;
+}
+
+/**
+ * Marks the synced segments of @param dirty clean, closes all the fds and frees the array from
+ * aesd_log_dup_dirty(). Segments dropped by retention meanwhile are ignored.
+ */
+void aesd_log_release_dirty(struct aesd_segment_log *log, struct aesd_dirty_segment *dirty, int num_dirty)
+{
+    for (int i = 0; i < num_dirty; i++) {
+        if (dirty[i].synced) {
+            mark_synced(log, &dirty[i]);
+        }
+        close(dirty[i].fd);
+        if (dirty[i].lines_fd != -1) {
+            close(dirty[i].lines_fd);
+        }
+    }
+    free(dirty);
+}
+
+/**
+ * Drops whole segments from the front of @param log while the retained size is over retention_bytes
+ * or the oldest segment's last append is older than retention_secs. The active segment is never dropped.
+ */
+void aesd_log_apply_retention(struct aesd_segment_log *log)
+{
+    time_t now = time(NULL);
+    size_t numDropped = 0;
+
+    while (log->num_segments - numDropped > 1) {
+        struct aesd_segment *oldest = &log->segments[numDropped];
+        unsigned long long retained = log->end_offset - oldest->base_offset;
+        bool overSize = log->config.retention_bytes && retained > log->config.retention_bytes;
+        bool tooOld = log->config.retention_secs && oldest->mtime + log->config.retention_secs <= now;
+        if (!overSize && !tooOld) {
+            break;
+        }
+
+        segment_close(log, oldest, true);
+        numDropped++;
+    }
+
+    if (numDropped) {
+        memmove(log->segments, log->segments + numDropped,
+                (log->num_segments - numDropped) * sizeof(*log->segments));
+        log->num_segments -= numDropped;
+        log->first_dirty = log->first_dirty > numDropped ? log->first_dirty - numDropped : 0;
+        line_index_trim(log);
+        time_index_trim(log);
+    }
+}
+
+/**
+ * Closes every segment of @param log, deleting the files and the directory when @param remove_files is set,
+ * otherwise leaving a fresh checkpoint behind if keep_checkpoint is configured.
+ */
+void aesd_log_close(struct aesd_segment_log *log, bool remove_files)
+{
+    if (!remove_files && log->config.keep_checkpoint && log->num_segments) {
+        aesd_log_checkpoint(log);
+    }
+
+    for (size_t i = 0; i < log->num_segments; i++) {
+        segment_close(log, &log->segments[i], remove_files);
+    }
+    free(log->segments);
+    log->segments = NULL;
+    free(log->lines.offsets);
+    memset(&log->lines, 0, sizeof(log->lines));
+    free(log->times.entries);
+    memset(&log->times, 0, sizeof(log->times));
+    log->num_segments = 0;
+    log->segments_cap = 0;
+    log->first_dirty = 0;
+
+    if (remove_files && rmdir(log->dir) != 0) {
+        syslog(LOG_ERR, "Was unable to delete the directory %s\n", log->dir);
+    }
+}
+
+/**
+ * Captures the segment list and the time index of @param log for dir/checkpoint, along with the dirty
+ * segments they describe. Called with the log's lock held, the file is written by aesd_log_checkpoint_write()
+ * and @param cp released by aesd_log_checkpoint_end() under the lock again.
+ * @return 0 on success, -1 on failure or while another checkpoint is in progress (@param cp is then unused)
+ */
+int aesd_log_checkpoint_begin(struct aesd_segment_log *log, struct aesd_log_checkpoint *cp)
+{
+    memset(cp, 0, sizeof(*cp));
+    if (log->checkpoint_busy) {
+        return -1; //Renaming an older state over a newer checkpoint would lose it
+    }
+    snprintf(cp->path, sizeof(cp->path), "%s/checkpoint", log->dir);
+    snprintf(cp->tmp_path, sizeof(cp->tmp_path), "%s/checkpoint.tmp", log->dir);
+
+    struct checkpoint_header header = {
+        .magic = CHECKPOINT_MAGIC,
+        .version = CHECKPOINT_VERSION,
+        .end_offset = log->end_offset,
+        .end_record = log->end_record,
+        .num_segments = log->num_segments,
+        .num_times = log->times.len,
+    };
+    cp->len = sizeof(header) + log->num_segments * sizeof(struct checkpoint_segment) +
+            log->times.len * sizeof(struct checkpoint_time);
+    cp->data = malloc(cp->len);
+    if (!cp->data) {
+        return -1;
+    }
+    cp->num_dirty = aesd_log_dup_dirty(log, &cp->dirty);
+    if (cp->num_dirty < 0) {
+        free(cp->data);
+        cp->data = NULL;
+        return -1;
+    }
+
+    char *pos = cp->data;
+    memcpy(pos, &header, sizeof(header));
+    pos += sizeof(header);
+    for (size_t i = 0; i < log->num_segments; i++) {
+        struct aesd_segment *seg = &log->segments[i];
+        struct checkpoint_segment cpSeg = {
+            .base_offset = seg->base_offset,
+            .base_record = seg->base_record,
+            .size = seg->size,
+            .num_records = seg->num_records,
+            .mtime = seg->mtime,
+        };
+        memcpy(pos, &cpSeg, sizeof(cpSeg));
+        pos += sizeof(cpSeg);
+    }
+    for (size_t i = 0; i < log->times.len; i++) {
+        struct aesd_time_entry *entry = &log->times.entries[log->times.head + i];
+        struct checkpoint_time cpTime = {
+            .time = entry->time,
+            .offset = entry->offset,
+        };
+        memcpy(pos, &cpTime, sizeof(cpTime));
+        pos += sizeof(cpTime);
+    }
+
+    log->checkpoint_busy = true;
+    return 0;
+}
+
+/**
+ * Syncs the segments captured in @param cp, then writes it to dir/checkpoint through a temporary file and
+ * rename(). Needs no lock. Recovery trusts the segment sizes a checkpoint records, so nothing is written
+ * unless every segment it describes made it to the disk first.
+ * @return 0 on success, -1 on failure
+ */
+int aesd_log_checkpoint_write(struct aesd_log_checkpoint *cp)
+{
+    for (int i = 0; i < cp->num_dirty; i++) {
+        if (aesd_log_sync_dirty(&cp->dirty[i]) != 0) {
+            syslog(LOG_ERR, "Failed to sync segment %020llu for checkpoint: %s\n",
+                    cp->dirty[i].base_offset, strerror(errno));
+            return -1;
+        }
+    }
+
+    int fd = open(cp->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to create checkpoint %s: %s\n", cp->tmp_path, strerror(errno));
+        return -1;
+    }
+
+    int status = write_all(fd, cp->data, cp->len);
+    if (status == 0) {
+        status = fdatasync(fd);
+    }
+    close(fd);
+    if (status == 0) {
+        status = rename(cp->tmp_path, cp->path);
+    }
+    if (status != 0) {
+        syslog(LOG_ERR, "Failed to write checkpoint %s: %s\n", cp->path, strerror(errno));
+        unlink(cp->tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Releases @param cp, marking the segments it synced clean. Called with the log's lock held.
+ */
+void aesd_log_checkpoint_end(struct aesd_segment_log *log, struct aesd_log_checkpoint *cp)
+{
+    aesd_log_release_dirty(log, cp->dirty, cp->num_dirty);
+    free(cp->data);
+    memset(cp, 0, sizeof(*cp));
+    log->checkpoint_busy = false;
+}
+
+/**
+ * Writes the segment list and the time index to dir/checkpoint in one go, syncing the segments first,
+ * so aesd_log_recover() only has to scan what was appended after the last checkpoint.
+ * Blocks on the disk, callers holding a lock others wait on use the begin/write/end steps instead.
+ * @return 0 on success, -1 on failure
+ */
+int aesd_log_checkpoint(struct aesd_segment_log *log)
+{
+    struct aesd_log_checkpoint cp;
+    if (aesd_log_checkpoint_begin(log, &cp) != 0) {
+        return -1;
+    }
+    int status = aesd_log_checkpoint_write(&cp);
+    aesd_log_checkpoint_end(log, &cp);
+    return status;
+}
+
+//pread() exactly len bytes, @return 0 on success, -1 on error or short file
+static int read_full(int fd, void *buf, size_t len, off_t position)
+{
+    char *dst = buf;
+    while (len > 0) {
+        ssize_t numRead = pread(fd, dst, len, position);
+        if (numRead == -1 && errno == EINTR) {
+            continue;
+        }
+        if (numRead <= 0) {
+            return -1;
+        }
+        dst += numRead;
+        len -= numRead;
+        position += numRead;
+    }
+    return 0;
+}
+
+/**
+ * Reads dir/checkpoint. On success @param segments_rtn and @param times_rtn are malloc()ed for the caller.
+ * @return 0 if a valid checkpoint was loaded, -1 otherwise
+ */
+static int checkpoint_load(const char *dir, struct checkpoint_header *header,
+            struct checkpoint_segment **segments_rtn, struct checkpoint_time **times_rtn)
+{
+    char path[300];
+    snprintf(path, sizeof(path), "%s/checkpoint", dir);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    struct checkpoint_segment *cpSegments = NULL;
+    struct checkpoint_time *cpTimes = NULL;
+    if (fstat(fd, &st) != 0 || read_full(fd, header, sizeof(*header), 0) != 0 ||
+            header->magic != CHECKPOINT_MAGIC || header->version != CHECKPOINT_VERSION) {
+        goto invalid;
+    }
+
+    //Sizes must add up exactly before anything is allocated from them
+    size_t segmentsBytes = header->num_segments * sizeof(*cpSegments);
+    size_t timesBytes = header->num_times * sizeof(*cpTimes);
+    if (header->num_segments > (size_t)st.st_size || header->num_times > (size_t)st.st_size ||
+            sizeof(*header) + segmentsBytes + timesBytes != (size_t)st.st_size) {
+        goto invalid;
+    }
+
+    cpSegments = malloc(segmentsBytes + 1);
+    cpTimes = malloc(timesBytes + 1);
+    if (!cpSegments || !cpTimes ||
+            read_full(fd, cpSegments, segmentsBytes, sizeof(*header)) != 0 ||
+            read_full(fd, cpTimes, timesBytes, sizeof(*header) + segmentsBytes) != 0) {
+        goto invalid;
+    }
+
+    close(fd);
+    *segments_rtn = cpSegments;
+    *times_rtn = cpTimes;
+    return 0;
+
+    invalid:
+        syslog(LOG_ERR, "Ignoring invalid checkpoint %s\n", path);
+        free(cpSegments);
+        free(cpTimes);
+        close(fd);
+        return -1;
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+    unsigned long long lhs = *(const unsigned long long *)a;
+    unsigned long long rhs = *(const unsigned long long *)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/**
+ * Collects the base offsets of every *.log segment in @param dir, oldest first, into a malloc()ed array.
+ * @return number of segments found, -1 on failure
+ */
+static ssize_t list_segments(const char *dir, unsigned long long **offsets_rtn)
+{
+    DIR *dirp = opendir(dir);
+    if (!dirp) {
+        return -1;
+    }
+
+    unsigned long long *offsets = NULL;
+    size_t numOffsets = 0, cap = 0;
+    struct dirent *dent;
+    while ((dent = readdir(dirp)) != NULL) {
+        char *endPtr;
+        unsigned long long baseOffset = strtoull(dent->d_name, &endPtr, 10);
+        if (endPtr == dent->d_name || strcmp(endPtr, ".log") != 0) {
+            continue;
+        }
+        if (numOffsets == cap) {
+            cap = cap ? cap * 2 : 16;
+            unsigned long long *newOffsets = realloc(offsets, cap * sizeof(*offsets));
+            if (!newOffsets) {
+                free(offsets);
+                closedir(dirp);
+                return -1;
+            }
+            offsets = newOffsets;
+        }
+        offsets[numOffsets++] = baseOffset;
+    }
+    closedir(dirp);
+
+    qsort(offsets, numOffsets, sizeof(*offsets), compare_offsets);
+    *offsets_rtn = offsets;
+    return numOffsets;
+}
+
+/**
+ * Opens the existing segment at @param base_offset as the new last segment of @param log.
+ * @param st_rtn filled with the segment file's stat
+ * @return the segment, or NULL on failure
+ */
+static struct aesd_segment *segment_reopen(struct aesd_segment_log *log, unsigned long long base_offset,
+            struct stat *st_rtn)
+{
+    char path[300];
+
+    struct aesd_segment *seg = segment_alloc(log);
+    if (!seg) {
+        return NULL;
+    }
+
+    segment_path(log, base_offset, "log", path, sizeof(path));
+    seg->fd = open(path, O_RDWR | O_APPEND);
+    if (seg->fd == -1 || fstat(seg->fd, st_rtn) != 0) {
+        syslog(LOG_ERR, "Failed to reopen segment %s: %s\n", path, strerror(errno));
+        if (seg->fd != -1) {
+            close(seg->fd);
+        }
+        return NULL;
+    }
+    seg->mtime = st_rtn->st_mtime;
+
+    segment_path(log, base_offset, "index", path, sizeof(path));
+    seg->index_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+
+    if (log->config.persist_line_index) {
+        segment_path(log, base_offset, "lines", path, sizeof(path));
+        seg->lines_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    }
+
+    log->num_segments++;
+    return seg;
+}
+
+/**
+ * Loads the persisted .lines entries of the first @param num_records records of @param seg into the
+ * dense line index and cuts the file back to them, so records after the checkpoint are re-added by the scan.
+ * @return 0 if all of them were there, -1 if the segment has to be rescanned instead
+ */
+static int segment_load_lines(struct aesd_segment_log *log, struct aesd_segment *seg,
+            unsigned long long num_records, size_t valid_size)
+{
+    uint64_t batch[512];
+
+    if (seg->lines_fd == -1) {
+        return -1;
+    }
+
+    for (unsigned long long loaded = 0; loaded < num_records; ) {
+        size_t batchLen = num_records - loaded;
+        if (batchLen > sizeof(batch) / sizeof(batch[0])) {
+            batchLen = sizeof(batch) / sizeof(batch[0]);
+        }
+        if (read_full(seg->lines_fd, batch, batchLen * sizeof(batch[0]), loaded * sizeof(batch[0])) != 0) {
+            return -1;
+        }
+        for (size_t i = 0; i < batchLen; i++, loaded++) {
+            if (batch[i] < seg->base_offset || batch[i] >= seg->base_offset + valid_size ||
+                    line_index_push(&log->lines, seg->base_record + loaded, batch[i]) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    return ftruncate(seg->lines_fd, num_records * sizeof(uint64_t));
+}
+
+/**
+ * Loads the sparse .index entries of @param seg that fall inside its first @param valid_size bytes
+ * and cuts the file back to them, later entries are rebuilt by the tail scan.
+ */
+static void segment_load_index(struct aesd_segment *seg, size_t valid_size)
+{
+    struct aesd_index_entry entry;
+    off_t position = 0;
+
+    while (seg->index_fd != -1 && read_full(seg->index_fd, &entry, sizeof(entry), position) == 0) {
+        bool inOrder = seg->index_len == 0 || (entry.record > seg->index[seg->index_len - 1].record &&
+                entry.position > seg->index[seg->index_len - 1].position);
+        if (entry.position >= valid_size || entry.record < seg->base_record ||
+                entry.record >= seg->base_record + seg->num_records || !inOrder) {
+            break;
+        }
+
+        //Already on disk, so only the in-memory copy is added
+        int fd = seg->index_fd;
+        seg->index_fd = -1;
+        int status = segment_add_index(seg, entry.record, entry.position);
+        seg->index_fd = fd;
+        if (status != 0) {
+            break;
+        }
+        position += sizeof(entry);
+    }
+
+    if (seg->index_fd != -1 && ftruncate(seg->index_fd, position) != 0) {
+        syslog(LOG_ERR, "Failed to trim sparse index: %s\n", strerror(errno));
+    }
+}
+
+//@return the end of the last complete ('\n' terminated) record in [from, size) of fd, or from if there is none
+static size_t last_record_end(int fd, size_t from, size_t size)
+{
+    char buf[4096];
+
+    while (size > from) {
+        size_t chunk = size - from < sizeof(buf) ? size - from : sizeof(buf);
+        if (read_full(fd, buf, chunk, size - chunk) != 0) {
+            return from;
+        }
+        for (size_t i = chunk; i > 0; i--) {
+            if (buf[i - 1] == '\n') {
+                return size - chunk + i;
+            }
+        }
+        size -= chunk;
+    }
+    return from;
+}
+
+//Indexes bytes [seg->size, to) of the segment file, which were written after the last checkpoint
+static int segment_scan(struct aesd_segment_log *log, struct aesd_segment *seg, size_t to)
+{
+    char buf[16384];
+
+    while (seg->size < to) {
+        size_t chunk = to - seg->size < sizeof(buf) ? to - seg->size : sizeof(buf);
+        if (read_full(seg->fd, buf, chunk, seg->size) != 0) {
+            return -1;
+        }
+        index_records(log, seg, buf, chunk);
+    }
+    return 0;
+}
+
+//Deletes the files of a segment that can't be recovered
+static void segment_discard(struct aesd_segment_log *log, unsigned long long base_offset)
+{
+    struct aesd_segment seg = {
+        .base_offset = base_offset,
+        .fd = -1,
+        .index_fd = -1,
+        .lines_fd = -1,
+    };
+    syslog(LOG_ERR, "Discarding unreachable segment %020llu\n", base_offset);
+    segment_close(log, &seg, true);
+}
+
+/**
+ * Warm restart: reopens the log left in @param dir by an earlier run instead of starting empty.
+ * Segments covered by the checkpoint get their metadata, sparse index and (if persisted) line index
+ * from it without reading any data, only bytes appended after the checkpoint are scanned. A torn
+ * record at the end of a segment is cut off. Falls back to an empty log if dir holds no segments.
+ * @param config segment size and retention limits, copied into @param log
+ * @return 0 on success, -1 on failure
+ */
+int aesd_log_recover(struct aesd_segment_log *log, const char *dir, const struct aesd_log_config *config)
+{
+    memset(log, 0, sizeof(*log));
+    snprintf(log->dir, sizeof(log->dir), "%s", dir);
+    log->config = *config;
+    if (log->config.segment_bytes == 0) {
+        log->config.segment_bytes = AESD_LOG_DEFAULT_SEGMENT_BYTES;
+    }
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    unsigned long long *baseOffsets = NULL;
+    ssize_t numFiles = list_segments(dir, &baseOffsets);
+    if (numFiles <= 0) {
+        free(baseOffsets);
+        return aesd_log_open(log, dir, config);
+    }
+
+    struct checkpoint_header header = {0};
+    struct checkpoint_segment *cpSegments = NULL;
+    struct checkpoint_time *cpTimes = NULL;
+    if (checkpoint_load(dir, &header, &cpSegments, &cpTimes) != 0) {
+        header.num_segments = 0;
+        header.num_times = 0;
+    }
+
+    size_t cpIndex = 0;
+    for (ssize_t i = 0; i < numFiles; i++) {
+        if (i > 0 && baseOffsets[i] != log->end_offset) {
+            //A gap means the previous segment lost its tail, anything after it can't be placed
+            for (; i < numFiles; i++) {
+                segment_discard(log, baseOffsets[i]);
+            }
+            break;
+        }
+
+        while (cpIndex < header.num_segments && cpSegments[cpIndex].base_offset < baseOffsets[i]) {
+            cpIndex++;
+        }
+        struct checkpoint_segment *cpSeg = NULL;
+        if (cpIndex < header.num_segments && cpSegments[cpIndex].base_offset == baseOffsets[i]) {
+            cpSeg = &cpSegments[cpIndex];
+        }
+
+        if (i == 0) {
+            log->end_offset = baseOffsets[0];
+            log->end_record = cpSeg ? cpSeg->base_record : 0;
+        }
+
+        struct stat st;
+        struct aesd_segment *seg = segment_reopen(log, baseOffsets[i], &st);
+        if (!seg) {
+            free(baseOffsets);
+            free(cpSegments);
+            free(cpTimes);
+            aesd_log_close(log, false);
+            return -1;
+        }
+        size_t fileSize = st.st_size;
+
+        //Trust the checkpointed prefix if it still lines up with the file and the segments before it
+        size_t trusted = 0;
+        if (cpSeg && cpSeg->base_record == log->end_record && cpSeg->size <= fileSize) {
+            trusted = cpSeg->size;
+            seg->num_records = cpSeg->num_records;
+            if (log->config.persist_line_index) {
+                if (segment_load_lines(log, seg, cpSeg->num_records, trusted) != 0) {
+                    trusted = 0;
+                    seg->num_records = 0;
+                    log->lines.len = 0;
+                }
+            } else {
+                log->lines.len = 0; //Older records are found through the sparse index instead
+            }
+        }
+        if (trusted == 0 && seg->lines_fd != -1 && ftruncate(seg->lines_fd, 0) != 0) {
+            syslog(LOG_ERR, "Failed to reset line index: %s\n", strerror(errno));
+        }
+        segment_load_index(seg, trusted);
+
+        seg->size = trusted;
+        log->end_offset += trusted;
+        log->end_record += seg->num_records;
+        log->partial_record = false;
+
+        size_t validEnd = last_record_end(seg->fd, trusted, fileSize);
+        if (validEnd < fileSize) {
+            syslog(LOG_INFO, "Dropping %zu bytes of torn record from segment %020llu\n",
+                    fileSize - validEnd, seg->base_offset);
+            if (ftruncate(seg->fd, validEnd) != 0) {
+                syslog(LOG_ERR, "Failed to truncate segment: %s\n", strerror(errno));
+            }
+        }
+        if (segment_scan(log, seg, validEnd) != 0) {
+            syslog(LOG_ERR, "Failed to scan segment %020llu\n", seg->base_offset);
+        }
+        seg->mtime = st.st_mtime;
+    }
+
+    //Timestamps survive if they point into what was recovered, appends after the checkpoint lose theirs
+    for (size_t i = 0; i < header.num_times; i++) {
+        struct aesd_time_index *times = &log->times;
+        if (cpTimes[i].offset < aesd_log_start_offset(log) || cpTimes[i].offset >= log->end_offset ||
+                (times->len > 0 && cpTimes[i].time < times->entries[times->len - 1].time)) {
+            continue;
+        }
+        if (times->len == times->cap) {
+            size_t newCap = times->cap ? times->cap * 2 : 64;
+            struct aesd_time_entry *newEntries = realloc(times->entries, newCap * sizeof(*newEntries));
+            if (!newEntries) {
+                break;
+            }
+            times->entries = newEntries;
+            times->cap = newCap;
+        }
+        times->entries[times->len].time = cpTimes[i].time;
+        times->entries[times->len].offset = cpTimes[i].offset;
+        times->len++;
+    }
+
+    free(baseOffsets);
+    free(cpSegments);
+    free(cpTimes);
+
+    aesd_log_apply_retention(log);
+    return 0;
+}
@@ -0,0 +1,269 @@
+/**
+ * @file aesd-segment-log.h
+ * @brief Segmented append-only log used as the aesdsocket file backend
+ *
+ * The log lives in a directory of fixed-size segment files named after the logical byte offset
+ * of their first byte, e.g. 00000000000000000000.log, each with a sparse .index file mapping
+ * line (record) numbers to byte positions. Retention deletes whole segments from the front.
+ * A dense in-memory line index additionally gives the start offset of every retained record in O(1),
+ * optionally persisted per segment in a .lines file. A time index maps append times to offsets
+ * for records appended with aesd_log_append_timed(). With keep_checkpoint a small checkpoint file
+ * records segment metadata and the time index, so aesd_log_recover() can reopen the log after a
+ * restart while only scanning what was appended since.
+ *
+ */
+
+#ifndef AESD_SEGMENT_LOG_H
+#define AESD_SEGMENT_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define AESD_LOG_DEFAULT_SEGMENT_BYTES (1024 * 1024)
+/**
+ * A sparse index entry is written at the first record boundary at least this many bytes
+ * after the previous one, so finding a record scans at most about this much of a segment.
+ */
+#define AESD_LOG_INDEX_INTERVAL_BYTES 4096
+
+/**
+ * On-disk and in-memory sparse index entry
+ */
+struct aesd_index_entry
+{
+    /**
+     * Absolute number of the record (line) starting at position
+     */
+    uint64_t record;
+    /**
+     * Byte position of that record within the segment file
+     */
+    uint64_t position;
+};
+
+struct aesd_segment
+{
+    /**
+     * Logical offset of the first byte in this segment, also used for the file names
+     */
+    unsigned long long base_offset;
+    /**
+     * Absolute number of the first record in this segment
+     */
+    unsigned long long base_record;
+    /**
+     * Bytes currently stored in the segment file
+     */
+    size_t size;
+    /**
+     * Number of records that start in this segment
+     */
+    unsigned long long num_records;
+    /**
+     * Time of the last append, used for age based retention
+     */
+    time_t mtime;
+    /**
+     * Bumped by every append. synced_writes is the value it had when the last successful fdatasync()
+     * of the segment started, so the segment is dirty while the two differ.
+     */
+    unsigned long long writes;
+    unsigned long long synced_writes;
+    int fd;
+    int index_fd;
+    /**
+     * Persisted dense line index, one uint64_t offset per record, -1 unless persist_line_index is set
+     */
+    int lines_fd;
+    struct aesd_index_entry *index;
+    size_t index_len;
+    size_t index_cap;
+};
+
+struct aesd_log_config
+{
+    /**
+     * Roll over to a new segment once the active one would grow past this many bytes
+     */
+    size_t segment_bytes;
+    /**
+     * Delete the oldest segments while more than this many bytes are retained, 0 for no limit
+     */
+    unsigned long long retention_bytes;
+    /**
+     * Delete segments whose last append is older than this many seconds, 0 for no limit
+     */
+    time_t retention_secs;
+    /**
+     * Also write the dense line index to a .lines file next to each segment
+     */
+    bool persist_line_index;
+    /**
+     * Maintain dir/checkpoint (on close and via aesd_log_checkpoint()) for aesd_log_recover()
+     */
+    bool keep_checkpoint;
+};
+
+/**
+ * Start offsets of every retained record, offsets[head + i] belongs to record first_record + i
+ */
+struct aesd_line_index
+{
+    unsigned long long *offsets;
+    unsigned long long first_record;
+    size_t head;
+    size_t len;
+    size_t cap;
+};
+
+struct aesd_time_entry
+{
+    time_t time;
+    /**
+     * Logical start offset of the record appended at time
+     */
+    unsigned long long offset;
+};
+
+/**
+ * Time ordered entries, live ones are entries[head] .. entries[head + len - 1]
+ */
+struct aesd_time_index
+{
+    struct aesd_time_entry *entries;
+    size_t head;
+    size_t len;
+    size_t cap;
+};
+
+struct aesd_segment_log
+{
+    char dir[256];
+    struct aesd_log_config config;
+    /**
+     * Segments ordered oldest first, the last one is the active segment appended to
+     */
+    struct aesd_segment *segments;
+    size_t num_segments;
+    size_t segments_cap;
+    /**
+     * Logical offset one past the last byte written
+     */
+    unsigned long long end_offset;
+    /**
+     * Number of records started so far, i.e. the number the next record will get
+     */
+    unsigned long long end_record;
+    /**
+     * True when the last append did not end with '\n', the next one continues that record
+     */
+    bool partial_record;
+    /**
+     * No segment before this index is dirty, where aesd_log_dup_dirty() starts looking
+     */
+    size_t first_dirty;
+    /**
+     * Set between aesd_log_checkpoint_begin() and aesd_log_checkpoint_end(), one checkpoint is written at a time
+     */
+    bool checkpoint_busy;
+    struct aesd_line_index lines;
+    struct aesd_time_index times;
+};
+
+/**
+ * A dirty segment handed out by aesd_log_dup_dirty()
+ */
+struct aesd_dirty_segment
+{
+    /**
+     * dup() of the segment file and of its .lines file (-1 unless persist_line_index is set)
+     */
+    int fd;
+    int lines_fd;
+    /**
+     * Identifies the segment for aesd_log_release_dirty(), and the writes an fdatasync() started now covers
+     */
+    unsigned long long base_offset;
+    unsigned long long writes;
+    /**
+     * Set by aesd_log_sync_dirty() once both files are on disk
+     */
+    bool synced;
+};
+
+/**
+ * State captured by aesd_log_checkpoint_begin() under the caller's lock, so the slow part,
+ * aesd_log_checkpoint_write(), can run without it
+ */
+struct aesd_log_checkpoint
+{
+    char path[300];
+    char tmp_path[300];
+    /**
+     * The checkpoint file contents, describing the log when the checkpoint was begun
+     */
+    char *data;
+    size_t len;
+    /**
+     * Segments that must reach the disk before the checkpoint may describe them
+     */
+    struct aesd_dirty_segment *dirty;
+    int num_dirty;
+};
+
+extern int aesd_log_open(struct aesd_segment_log *log, const char *dir, const struct aesd_log_config *config);
+
+extern int aesd_log_recover(struct aesd_segment_log *log, const char *dir, const struct aesd_log_config *config);
+
+extern int aesd_log_checkpoint(struct aesd_segment_log *log);
+
+extern int aesd_log_checkpoint_begin(struct aesd_segment_log *log, struct aesd_log_checkpoint *cp);
+
+extern int aesd_log_checkpoint_write(struct aesd_log_checkpoint *cp);
+
+extern void aesd_log_checkpoint_end(struct aesd_segment_log *log, struct aesd_log_checkpoint *cp);
+
+extern ssize_t aesd_log_append(struct aesd_segment_log *log, const char *buf, size_t len);
+
+extern ssize_t aesd_log_append_timed(struct aesd_segment_log *log, const char *buf, size_t len, time_t when);
+
+extern ssize_t aesd_log_read(struct aesd_segment_log *log, unsigned long long offset, char *buf, size_t len);
+
+extern int aesd_log_find_record(struct aesd_segment_log *log, unsigned long long record,
+            unsigned long long *offset_rtn);
+
+extern int aesd_log_record_offset(struct aesd_segment_log *log, unsigned long long record,
+            unsigned long long *offset_rtn, unsigned long long *size_rtn);
+
+extern int aesd_log_find_time(struct aesd_segment_log *log, time_t since, unsigned long long *offset_rtn);
+
+extern int aesd_log_dup_dirty(struct aesd_segment_log *log, struct aesd_dirty_segment **dirty_rtn);
+
+extern int aesd_log_sync_dirty(struct aesd_dirty_segment *dirty);
+
+extern void aesd_log_release_dirty(struct aesd_segment_log *log, struct aesd_dirty_segment *dirty, int num_dirty);
+
+extern void aesd_log_apply_retention(struct aesd_segment_log *log);
+
+extern void aesd_log_close(struct aesd_segment_log *log, bool remove_files);
+
+/**
+ * @return the logical offset of the oldest retained byte
+ */
+static inline unsigned long long aesd_log_start_offset(const struct aesd_segment_log *log)
+{
+    return log->num_segments ? log->segments[0].base_offset : log->end_offset;
+}
+
+/**
+ * @return the absolute number of the oldest retained record
+ */
+static inline unsigned long long aesd_log_start_record(const struct aesd_segment_log *log)
+{
+    return log->num_segments ? log->segments[0].base_record : log->end_record;
+}
+
+#endif /* AESD_SEGMENT_LOG_H */
@@ -18,25 +18,249 @@
 #include <stdio.h>
 #include <time.h>
 #include "queue.h"
+#include "aesd-segment-log.h"
 
 #include <sys/ioctl.h>
 #include "../aesd-char-driver/aesd_ioctl.h"
 
-#define USE_AESD_CHAR_DEVICE 1
-#ifdef USE_AESD_CHAR_DEVICE
+//Build with -DUSE_AESD_CHAR_DEVICE=0 to use the regular file backend instead of the driver
+#ifndef USE_AESD_CHAR_DEVICE
+    #define USE_AESD_CHAR_DEVICE 1
+#endif
+#if USE_AESD_CHAR_DEVICE
     #define TEMP_FILE "/dev/aesdchar"
     #define USE_TIMESTAMP false
 #else
-    #define TEMP_FILE "/var/tmp/aesdsocketdata"
+    #define TEMP_FILE "/var/tmp/aesdsocketdata" //Directory holding the segmented log
     #define USE_TIMESTAMP true
 #endif
 
 #define MAX_PACKET_SIZE 65536 //Buffer size for recv. Needs to be large enough to handle long-string.txt
 #define RFC2822_FORMAT "timestamp:%a, %d %b %Y %T %z\n"
+#define DEFAULT_SYNC_INTERVAL_MS 1000
 
 //Global flag for signal handling
 bool signalCaughtFlag = false;
 
+//File backend store, only touched while holding fileMutex. Sizes set with -S, -R and -A.
+static struct aesd_segment_log storeLog;
+static struct aesd_log_config logConfig = {
+    .segment_bytes = AESD_LOG_DEFAULT_SEGMENT_BYTES,
+    .retention_bytes = 0,
+    .retention_secs = 0,
+};
+//-T: also index client appends by time for SINCE:, not just the timer's timestamp lines
+static bool timeIndexAppends = false;
+//-r: keep the store across runs, recovering it at startup instead of starting empty
+static bool warmRestart = false;
+
+//How hard we try to get acknowledged lines onto disk before replying (-s option)
+enum durability_mode {
+    DURABILITY_NONE,     //Never sync, the page cache is written back whenever the kernel decides
+    DURABILITY_GROUP,    //Replies wait for an fdatasync() shared by every append pending at the time
+    DURABILITY_INTERVAL  //A timer calls fdatasync() every syncIntervalMs, replies don't wait for it
+};
+
+struct durability_data {
+    enum durability_mode mode;
+    long syncIntervalMs;
+    int syncfd; //Char device only, opened once at startup. The file backend syncs its dirty segments.
+    pthread_mutex_t* fileMutex;
+
+    pthread_mutex_t syncMutex;
+    pthread_cond_t syncCond;
+    unsigned long long appendSeq;  //Appends written so far, bumped while holding fileMutex
+    unsigned long long durableSeq; //Appends covered by a completed fdatasync()
+    unsigned long long failedSeq;  //Appends covered by the last fdatasync() that failed, never acked
+    bool syncInProgress;           //Set while a group leader is inside fdatasync()
+
+    //Stats, reported at exit
+    struct timespec startTime;
+    unsigned long long numSyncs;
+    unsigned long long totalLatencyNs; //recv() complete -> reply allowed, summed over all appends
+    unsigned long long maxLatencyNs;
+};
+
+static struct durability_data durability = {
+    .mode = DURABILITY_NONE,
+    .syncIntervalMs = DEFAULT_SYNC_INTERVAL_MS,
+    .syncfd = -1,
+    .syncMutex = PTHREAD_MUTEX_INITIALIZER,
+    .syncCond = PTHREAD_COND_INITIALIZER,
+};
+
+static const char* durability_mode_str(enum durability_mode mode) {
+    switch (mode) {
+        case DURABILITY_GROUP:
+            return "group";
+        case DURABILITY_INTERVAL:
+            return "interval";
+        default:
+            return "none";
+    }
+}
+
+static unsigned long long elapsed_ns(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+}
+
+static int durability_sync_fd(int fd) {
+    if (fdatasync(fd) != 0 && errno != EINVAL && errno != EROFS) {
+        perror("Failed fdatasync()");
+        syslog(LOG_ERR, "Failed fdatasync(): %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+//fdatasync() the store. The char driver has no fsync, so EINVAL just means there is nothing to flush.
+//Must be called WITHOUT fileMutex held, it is only taken briefly to collect and mark the dirty segments.
+static int durability_sync(void) {
+    if (USE_AESD_CHAR_DEVICE) {
+        return durability.syncfd == -1 ? 0 : durability_sync_fd(durability.syncfd);
+    }
+
+    struct aesd_dirty_segment* dirty;
+    int status = 0;
+
+    pthread_mutex_lock(durability.fileMutex);
+    int numDirty = aesd_log_dup_dirty(&storeLog, &dirty);
+    pthread_mutex_unlock(durability.fileMutex);
+    if (numDirty < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < numDirty; i++) {
+        if (aesd_log_sync_dirty(&dirty[i]) != 0) {
+            perror("Failed fdatasync()");
+            syslog(LOG_ERR, "Failed fdatasync(): %s\n", strerror(errno));
+            status = -1;
+        }
+    }
+
+    //Only segments whose fdatasync() succeeded stop being dirty, the others are retried by the next sync
+    pthread_mutex_lock(durability.fileMutex);
+    aesd_log_release_dirty(&storeLog, dirty, numDirty);
+    pthread_mutex_unlock(durability.fileMutex);
+    return status;
+}
+
+//Must be called with fileMutex held right after a client append, so sequence numbers follow file order.
+static unsigned long long durability_note_append(void) {
+    pthread_mutex_lock(&durability.syncMutex);
+    unsigned long long seq = ++durability.appendSeq;
+    pthread_mutex_unlock(&durability.syncMutex);
+    return seq;
+}
+
+/*
+* Blocks until append number 'seq' is on disk (group mode only, other modes return right away).
+* The first waiter to find no sync running becomes the leader and syncs everything appended so far,
+* every other waiter sleeps and is covered by that same fdatasync(). Call WITHOUT fileMutex held so
+* other clients can keep appending into the next batch while the leader is syncing.
+* Returns -1 if the fdatasync() covering the append failed, the client must not be acked then.
+*/
+static int durability_wait(unsigned long long seq) {
+    if (durability.mode != DURABILITY_GROUP) {
+        return 0;
+    }
+
+    int status = 0;
+    pthread_mutex_lock(&durability.syncMutex);
+    while (durability.durableSeq < seq) {
+        if (durability.failedSeq >= seq) {
+            status = -1;
+            break;
+        }
+        if (durability.syncInProgress) {
+            pthread_cond_wait(&durability.syncCond, &durability.syncMutex);
+            continue;
+        }
+
+        //Become the leader for everything appended up to now
+        unsigned long long batchEnd = durability.appendSeq;
+        durability.syncInProgress = true;
+        pthread_mutex_unlock(&durability.syncMutex);
+
+        int syncStatus = durability_sync();
+
+        pthread_mutex_lock(&durability.syncMutex);
+        durability.syncInProgress = false;
+        durability.numSyncs++;
+        //A failed batch wakes its waiters with an error, later appends are covered by the next leader
+        if (syncStatus == 0) {
+            durability.durableSeq = batchEnd;
+        }
+        else {
+            durability.failedSeq = batchEnd;
+        }
+        pthread_cond_broadcast(&durability.syncCond);
+    }
+    pthread_mutex_unlock(&durability.syncMutex);
+    return status;
+}
+
+static void durability_record_latency(const struct timespec* start) {
+    unsigned long long latency = elapsed_ns(start);
+
+    pthread_mutex_lock(&durability.syncMutex);
+    durability.totalLatencyNs += latency;
+    if (latency > durability.maxLatencyNs) {
+        durability.maxLatencyNs = latency;
+    }
+    pthread_mutex_unlock(&durability.syncMutex);
+}
+
+//Timer callback for interval mode, only syncs when something was appended since the last one
+static void interval_sync_thread(union sigval sigval) {
+    (void)sigval;
+
+    pthread_mutex_lock(&durability.syncMutex);
+    unsigned long long batchEnd = durability.appendSeq;
+    bool needSync = batchEnd > durability.durableSeq && !durability.syncInProgress;
+    if (needSync) {
+        durability.syncInProgress = true;
+    }
+    pthread_mutex_unlock(&durability.syncMutex);
+
+    if (!needSync) {
+        return;
+    }
+
+    int syncStatus = durability_sync();
+
+    pthread_mutex_lock(&durability.syncMutex);
+    durability.syncInProgress = false;
+    durability.numSyncs++;
+    //On failure the batch stays pending and the next tick tries again
+    if (syncStatus == 0) {
+        durability.durableSeq = batchEnd;
+    }
+    pthread_mutex_unlock(&durability.syncMutex);
+}
+
+//Throughput and ack latency for the selected mode, logged at exit
+static void durability_report(void) {
+    double seconds = elapsed_ns(&durability.startTime) / 1e9;
+    unsigned long long appends = durability.appendSeq;
+
+    char report[300];
+    snprintf(report, sizeof(report),
+        "durability=%s: %llu appends in %.3f s (%.1f appends/s), %llu syncs (%.2f appends/sync), "
+        "ack latency avg %.3f ms max %.3f ms",
+        durability_mode_str(durability.mode), appends, seconds,
+        seconds > 0 ? appends / seconds : 0.0,
+        durability.numSyncs,
+        durability.numSyncs ? (double)appends / durability.numSyncs : 0.0,
+        appends ? durability.totalLatencyNs / 1e6 / appends : 0.0,
+        durability.maxLatencyNs / 1e6);
+
+    syslog(LOG_INFO, "%s\n", report);
+    printf("%s\n", report);
+}
+
 
 struct thread_data{
 
@@ -76,14 +300,155 @@ static void signal_handler(int signal_number) { //Static = only visible to other
 }
 
 
+//Starts every run with an empty store: truncates the device, or opens a fresh segmented log.
+//With -r the device is left alone and the log is recovered from the last run instead.
+static int store_init(void) {
+    if (USE_AESD_CHAR_DEVICE && warmRestart) {
+        return 0;
+    }
+    if (USE_AESD_CHAR_DEVICE) {
+        FILE* fptr = fopen(TEMP_FILE, "w");
+        if (!fptr) {
+            syslog(LOG_ERR, "Truncating file '%s' failed\n", TEMP_FILE);
+            return -1;
+        }
+        fclose(fptr);
+        return 0;
+    }
+
+    if (warmRestart) {
+        struct timespec startTime;
+        clock_gettime(CLOCK_MONOTONIC, &startTime);
+        if (aesd_log_recover(&storeLog, TEMP_FILE, &logConfig) != 0) {
+            syslog(LOG_ERR, "Recovering log directory '%s' failed: %s\n", TEMP_FILE, strerror(errno));
+            return -1;
+        }
+        syslog(LOG_INFO, "Recovered %llu bytes in %zu segments (records %llu..%llu) in %.3f ms\n",
+            storeLog.end_offset - aesd_log_start_offset(&storeLog), storeLog.num_segments,
+            aesd_log_start_record(&storeLog), storeLog.end_record,
+            elapsed_ns(&startTime) / 1e6);
+        return 0;
+    }
+
+    if (aesd_log_open(&storeLog, TEMP_FILE, &logConfig) != 0) {
+        syslog(LOG_ERR, "Opening log directory '%s' failed: %s\n", TEMP_FILE, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+//Appends one packet. The char device is written through the thread's own fd so a later seekto
+//ioctl and read happen on the same open file. Called with fileMutex held.
+static ssize_t store_append(int tempfd, const char* buf, size_t len) {
+    if (USE_AESD_CHAR_DEVICE) {
+        return write(tempfd, buf, len);
+    }
+    if (timeIndexAppends) {
+        return aesd_log_append_timed(&storeLog, buf, len, time(NULL));
+    }
+    return aesd_log_append(&storeLog, buf, len);
+}
+
+//Points the next send_store_contents() at the oldest data still stored
+static int store_rewind(int tempfd, unsigned long long* replyOffset) {
+    if (USE_AESD_CHAR_DEVICE) {
+        return lseek(tempfd, 0, SEEK_SET) == -1 ? -1 : 0;
+    }
+    *replyOffset = aesd_log_start_offset(&storeLog);
+    return 0;
+}
+
+//AESDCHAR_IOCSEEKTO:X,Y. The char device does it in aesd_ioctl(), the file backend looks X up in the
+//log's dense line index so the reply starts with a single pread() at the target. Either way X counts
+//from the oldest write still stored. Called with fileMutex held.
+static int store_seekto(int tempfd, uint32_t writeCmd, uint32_t writeCmdOffset, unsigned long long* replyOffset) {
+    if (USE_AESD_CHAR_DEVICE) {
+        struct aesd_seekto args = {writeCmd, writeCmdOffset};
+        return ioctl(tempfd, AESDCHAR_IOCSEEKTO, &args);
+    }
+
+    unsigned long long recordOffset, recordSize;
+    unsigned long long record = aesd_log_start_record(&storeLog) + writeCmd;
+    if (aesd_log_record_offset(&storeLog, record, &recordOffset, &recordSize) != 0 ||
+            writeCmdOffset >= recordSize) {
+        errno = EINVAL;
+        return -1;
+    }
+    *replyOffset = recordOffset + writeCmdOffset;
+    return 0;
+}
+
+//SINCE:<epoch>. Binary searches the file backend's time index and points the reply at the first
+//indexed record at or after epoch, or at the end if there is none. The char device keeps no
+//timestamps, so there the reply is skipped. Called with fileMutex held.
+static int store_since(int tempfd, time_t since, unsigned long long* replyOffset) {
+    if (USE_AESD_CHAR_DEVICE) {
+        lseek(tempfd, 0, SEEK_END);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (aesd_log_find_time(&storeLog, since, replyOffset) != 0) {
+        *replyOffset = storeLog.end_offset;
+    }
+    return 0;
+}
+
+//Sends everything from the current position to the end of the store to the client.
+//Called with fileMutex held.
+static void send_store_contents(int tempfd, int connfd, unsigned long long replyOffset) {
+
+    if (!USE_AESD_CHAR_DEVICE) {
+        //Segments are read in place, only the ones at or after replyOffset are touched
+        char read_buf[4096];
+        ssize_t bytes_read;
+        while ((bytes_read = aesd_log_read(&storeLog, replyOffset, read_buf, sizeof(read_buf))) > 0) {
+            if (send(connfd, read_buf, bytes_read, MSG_NOSIGNAL) == -1) {
+                syslog(LOG_ERR, "Failed send()\n");
+                break;
+            }
+            replyOffset += bytes_read;
+        }
+        return;
+    }
+
+    //Need to send each line individually. Can't load the full file into RAM b/c of constraints.
+
+    //Reference: Below section generated by Copilot AI since FILE* fptr doesn't work with the ioctl fd
+    char read_buf[1024];
+    char line_buf[1024];
+    size_t line_len = 0;
+
+    ssize_t bytes_read;
+    while ((bytes_read = read(tempfd, read_buf, sizeof(read_buf))) > 0) {
+        for (ssize_t i = 0; i < bytes_read; i++) {
+            line_buf[line_len++] = read_buf[i];
+
+            if (read_buf[i] == '\n' || line_len == 1024 - 1) {
+                ssize_t status = send(connfd, line_buf, line_len, MSG_NOSIGNAL);
+                if (status == -1) {
+                    syslog(LOG_ERR, "Failed send()\n");
+                }
+                line_len = 0;
+            }
+        }
+    }
+}
+
+
 void* threadfunc(void* thread_param) {
 
     // bool threadSuccess = true;
 
-    int tempfd = open(TEMP_FILE, O_RDWR | O_APPEND);
-    if (tempfd == -1) {
-        perror("Failed to open device file");
-        syslog(LOG_ERR, "Failed to open device file");
+    //Only the char device needs a per-thread fd, the file backend log is shared under fileMutex
+    int tempfd = -1;
+    unsigned long long replyOffset = 0;
+    if (USE_AESD_CHAR_DEVICE) {
+        tempfd = open(TEMP_FILE, O_RDWR | O_APPEND);
+        if (tempfd == -1) {
+            perror("Failed to open device file");
+            syslog(LOG_ERR, "Failed to open device file");
+        }
     }
 
     struct thread_data* thread_func_args = (struct thread_data *) thread_param;
@@ -113,6 +478,10 @@ void* threadfunc(void* thread_param) {
         perror("Error on recv, either closed connection or recv error");
     }
     else {
+        //Start of the ack latency reported by durability_report()
+        struct timespec recvDoneTime;
+        clock_gettime(CLOCK_MONOTONIC, &recvDoneTime);
+
         //---------------------MUTEX LOCK-----------------------
         int status = pthread_mutex_lock(thread_func_args->fileMutex);
         if (status != 0) {
@@ -135,8 +504,11 @@ void* threadfunc(void* thread_param) {
                         //Add IOCSEEKTO handling here
                         //Send the X and Y vals to the driver ioctl
 
+                        //Only the start of the packet matters for commands, keep it NUL terminated
                         char temp[100];
-                        strncpy(temp, thread_func_args->pbuffPtr + startPacket, packetLen);
+                        size_t tempLen = packetLen < sizeof(temp) ? packetLen : sizeof(temp) - 1;
+                        memcpy(temp, thread_func_args->pbuffPtr + startPacket, tempLen);
+                        temp[tempLen] = '\0';
 
                         //strstr to check for substring
                         if (strstr(temp, "AESDCHAR_IOCSEEKTO:")) {
@@ -145,39 +517,62 @@ void* threadfunc(void* thread_param) {
                             afterCol = afterCol + 1;
 
                             //Extract X and Y values
-                            int xVal = atoi(strtok(afterCol, ","));
-                            int yVal = atoi(strtok(NULL, ","));
-
-                            //Send X&Y to AESDCHAR_IOCSEEKTO ioctl function in driver
-
-                            struct aesd_seekto args = {xVal, yVal};
+                            char* xStr = strtok(afterCol, ",");
+                            char* yStr = strtok(NULL, ",");
+                            int xVal = xStr ? atoi(xStr) : 0;
+                            int yVal = yStr ? atoi(yStr) : 0;
 
-                            
-
-                            status = ioctl(tempfd, AESDCHAR_IOCSEEKTO, &args);
+                            //Send X&Y to AESDCHAR_IOCSEEKTO ioctl function in driver (or the file backend index)
+                            status = store_seekto(tempfd, xVal, yVal, &replyOffset);
                             if (status != 0) {
                                 perror("Failed ioctl()\n");
                                 syslog(LOG_ERR, "Failed ioctl()\n");
+                                store_rewind(tempfd, &replyOffset);
                             }
-
-                            
+                            startPacket = i + 1;
 
                             //Ensure the read of the file and return over the socket
                             //uses the same fd used to send ioctl and is not closed and re-opened
                         }
+                        else if (!strncmp(temp, "SINCE:", strlen("SINCE:"))) {
+
+                            time_t since = (time_t)strtoll(temp + strlen("SINCE:"), NULL, 10);
+                            if (store_since(tempfd, since, &replyOffset) != 0) {
+                                perror("SINCE: not supported");
+                                syslog(LOG_ERR, "SINCE: not supported on %s\n", TEMP_FILE);
+                            }
+                            startPacket = i + 1;
+                        }
                         else {
 
                             //Reference: Below section generated by Copilot AI since FILE* fptr doesn't work with the ioctl fd
-                            ssize_t written = write(tempfd, thread_func_args->pbuffPtr + startPacket, packetLen);
-                            if (written != packetLen) {
+                            ssize_t written = store_append(tempfd, thread_func_args->pbuffPtr + startPacket, packetLen);
+                            if (written < 0 || (size_t)written != packetLen) {
                                 perror("Failed write()");
                                 syslog(LOG_ERR, "Failed write()");
                                 close(tempfd);
                                 break;
                             }
                             startPacket = i + 1;
+
+                            //In group mode the reply waits for the batch's fdatasync(). fileMutex is
+                            //dropped meanwhile so other clients can append into the same batch.
+                            unsigned long long appendSeq = durability_note_append();
+                            if (durability.mode == DURABILITY_GROUP) {
+                                pthread_mutex_unlock(thread_func_args->fileMutex);
+                                status = durability_wait(appendSeq);
+                                pthread_mutex_lock(thread_func_args->fileMutex);
+                                if (status != 0) {
+                                    //Not durable, close the connection without the reply that would ack it
+                                    syslog(LOG_ERR, "Failed to sync append, dropping connection from %s\n",
+                                        thread_func_args->ipaddrStr);
+                                    break;
+                                }
+                            }
+                            durability_record_latency(&recvDoneTime);
+
                             // Reset file offset to beginning for reading
-                            if (lseek(tempfd, 0, SEEK_SET) == -1) {
+                            if (store_rewind(tempfd, &replyOffset) == -1) {
                                 perror("Failed lseek()");
                                 syslog(LOG_ERR, "Failed lseek()");
                                 close(tempfd);
@@ -186,32 +581,7 @@ void* threadfunc(void* thread_param) {
                         }
 
                         //Need to return full file content to client as soon as received data packet completes
-                        //Need to send each line individually. Can't load the full file into RAM b/c of constraints.
-
-
-                    //Reference: Below section generated by Copilot AI since FILE* fptr doesn't work with the ioctl fd
-                    char read_buf[1024];
-                    char line_buf[1024];
-                    size_t line_len = 0;
-
-                    ssize_t bytes_read;
-                    while ((bytes_read = read(tempfd, read_buf, sizeof(read_buf))) > 0) {
-                        for (ssize_t i = 0; i < bytes_read; i++) {
-                            line_buf[line_len++] = read_buf[i];
-
-                            if (read_buf[i] == '\n' || line_len == 1024 - 1) {
-                                ssize_t status = send(*thread_func_args->connfd, line_buf, line_len, MSG_NOSIGNAL);
-                                if (status == -1) {
-                                    syslog(LOG_ERR, "Failed send()\n");
-                                }
-                                line_len = 0;
-                            }
-                        }
-                    }
-
-
-
-
+                        send_store_contents(tempfd, *thread_func_args->connfd, replyOffset);
                     }
                 }
         }
@@ -274,39 +644,116 @@ static void timer_thread ( union sigval sigval )
             fprintf(stderr, "strftime returned 0");
         }
 
-        FILE* fptr = fopen(TEMP_FILE, "a+"); 
-        if (!fptr) {
-            perror("Error opening or creating file.\n");
-            syslog(LOG_ERR, "Failed fopen() in timer thread\n");
-        }
-
         //Now append to file
         //Need to find '\n' char to determine size
         for (size_t i = 0; i < sizeof(outStr); i++) {
                 if (outStr[i] == '\n') {
                     size_t lineLen = i +  1;
-                    fwrite(outStr, 1, lineLen, fptr);
+                    if (aesd_log_append_timed(&storeLog, outStr, lineLen, t) == -1) {
+                        syslog(LOG_ERR, "Failed to append timestamp\n");
+                    }
                     break;
                 }
             }
 
-        
-        fclose(fptr);
+        //Bounds how much a warm restart has to rescan. Only the metadata is captured here, the
+        //segment syncs and the checkpoint file are written after the unlock so appends don't wait on the disk.
+        struct aesd_log_checkpoint checkpoint;
+        bool checkpointBegun = warmRestart && aesd_log_checkpoint_begin(&storeLog, &checkpoint) == 0;
 
         if ( pthread_mutex_unlock(td->fileMutex) != 0 ) {
             printf("Error %d (%s) unlocking thread data!\n",errno,strerror(errno));
         }
         //------------------END MUTEX LOCK-----------------------
+
+        if (checkpointBegun) {
+            aesd_log_checkpoint_write(&checkpoint);
+            pthread_mutex_lock(td->fileMutex);
+            aesd_log_checkpoint_end(&storeLog, &checkpoint);
+            pthread_mutex_unlock(td->fileMutex);
+        }
     }
 }
 
 
 
+static void log_usage(const char* prog) {
+    syslog(LOG_ERR, "Usage: %s [-d] [-s none|group|interval] [-i sync_interval_ms] "
+        "[-S segment_bytes] [-R retention_bytes] [-A retention_secs] [-x] [-T] [-r]\n", prog);
+}
+
 int main(int argc, char *argv[]) {
 
     //Set up logging since there is a daemon option for this program.
     openlog(NULL, LOG_CONS, LOG_USER);
 
+    //-d: daemon mode
+    //-s none|group|interval: durability mode, -i <ms>: sync period for interval mode
+    //-S <bytes>: segment size, -R <bytes> / -A <seconds>: retention by size / age (file backend)
+    //-x: persist the line index used by AESDCHAR_IOCSEEKTO next to each segment (file backend)
+    //-T: index every client append by time for SINCE:, not just timestamp lines (file backend)
+    //-r: warm restart, keep the store from the previous run instead of clearing it
+    bool daemonMode = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "ds:i:S:R:A:xTr")) != -1) {
+        switch (opt) {
+            case 'd':
+                daemonMode = true;
+                break;
+            case 's':
+                if (!strcmp(optarg, "none")) {
+                    durability.mode = DURABILITY_NONE;
+                } else if (!strcmp(optarg, "group")) {
+                    durability.mode = DURABILITY_GROUP;
+                } else if (!strcmp(optarg, "interval")) {
+                    durability.mode = DURABILITY_INTERVAL;
+                } else {
+                    syslog(LOG_ERR, "Invalid durability mode %s for %s\n", optarg, argv[0]);
+                    return -1;
+                }
+                break;
+            case 'i':
+                durability.syncIntervalMs = atol(optarg);
+                if (durability.syncIntervalMs <= 0) {
+                    syslog(LOG_ERR, "Invalid sync interval %s for %s\n", optarg, argv[0]);
+                    return -1;
+                }
+                break;
+            case 'S':
+                logConfig.segment_bytes = strtoull(optarg, NULL, 10);
+                if (logConfig.segment_bytes == 0) {
+                    syslog(LOG_ERR, "Invalid segment size %s for %s\n", optarg, argv[0]);
+                    return -1;
+                }
+                break;
+            case 'R':
+                logConfig.retention_bytes = strtoull(optarg, NULL, 10);
+                break;
+            case 'A':
+                logConfig.retention_secs = atol(optarg);
+                break;
+            case 'x':
+                logConfig.persist_line_index = true;
+                break;
+            case 'T':
+                timeIndexAppends = true;
+                break;
+            case 'r':
+                warmRestart = true;
+                logConfig.keep_checkpoint = true;
+                break;
+            default:
+                log_usage(argv[0]);
+                return -1;
+        }
+    }
+    //No positional arguments are taken, running on with one would skip the store setup below
+    if (optind < argc) {
+        syslog(LOG_ERR, "Invalid argument %s for %s\n", argv[optind], argv[0]);
+        log_usage(argv[0]);
+        return -1;
+    }
+
     //Moved
     // //Truncating file in case the last run had a kill signal and bypassed handling
     // FILE* fptr = fopen(TEMP_FILE, "w");
@@ -418,140 +865,126 @@ int main(int argc, char *argv[]) {
 
 
     //Forking after bind() for daemon mode
-    if (argc == 2) {
-        if (!strcmp(argv[1], "-d")) {
-
-            //Creating Daemon:
-            //Fork > Exit in Parent > Setsid > Chdir > Close fds > Redirect stdin, stdout, stderr to /dev/null
-            pid_t child_pid = fork();
-            if (child_pid == -1) {
-                syslog(LOG_ERR, "Failed fork()\n");
+    if (daemonMode) {
+
+        //Creating Daemon:
+        //Fork > Exit in Parent > Setsid > Chdir > Close fds > Redirect stdin, stdout, stderr to /dev/null
+        pid_t child_pid = fork();
+        if (child_pid == -1) {
+            syslog(LOG_ERR, "Failed fork()\n");
+        }
+        else if (child_pid == 0) { //Child Process
+            setsid(); //Want to not have a controlling terminal
+
+            //No chdir needed because not deleting any directories 
+            //Don't wan't to close FDs since part of this program is storing something in a file
+            
+            //Redirect stdin, out, and err to /dev/null
+            //Reference: Searched on Google for how to redirect these streams, received AI example and modified to add syslog calls
+        //-------------------
+            int dev_null_fd = open("/dev/null", O_RDWR);
+
+            if (dev_null_fd == -1) {
+                // perror("open /dev/null");
+                syslog(LOG_ERR, "Failed to open /dev/null\n");
+            }
+            // Redirect stdin (file descriptor 0) to /dev/null
+            if (dup2(dev_null_fd, STDIN_FILENO) == -1) {
+                // perror("dup2 STDIN_FILENO");
+                syslog(LOG_ERR, "Failed dup2 STDIN_FILENO\n");
+                close(dev_null_fd);
+            }
+            // Redirect stdout (file descriptor 1) to /dev/null
+            if (dup2(dev_null_fd, STDOUT_FILENO) == -1) {
+                // perror("dup2 STDOUT_FILENO");
+                syslog(LOG_ERR, "Failed dup2 STDOUT_FILENO\n");
+                close(dev_null_fd);
+            }
+            // Redirect stderr (file descriptor 2) to /dev/null
+            if (dup2(dev_null_fd, STDERR_FILENO) == -1) {
+                // perror("dup2 STDERR_FILENO");
+                syslog(LOG_ERR, "Failed dup2 STDERR_FILENO\n");
+                close(dev_null_fd);
             }
-            else if (child_pid == 0) { //Child Process
-                setsid(); //Want to not have a controlling terminal
 
-                //No chdir needed because not deleting any directories 
-                //Don't wan't to close FDs since part of this program is storing something in a file
-                
-                //Redirect stdin, out, and err to /dev/null
-                //Reference: Searched on Google for how to redirect these streams, received AI example and modified to add syslog calls
-            //-------------------
-                int dev_null_fd = open("/dev/null", O_RDWR);
 
-                if (dev_null_fd == -1) {
-                    // perror("open /dev/null");
-                    syslog(LOG_ERR, "Failed to open /dev/null\n");
-                }
-                // Redirect stdin (file descriptor 0) to /dev/null
-                if (dup2(dev_null_fd, STDIN_FILENO) == -1) {
-                    // perror("dup2 STDIN_FILENO");
-                    syslog(LOG_ERR, "Failed dup2 STDIN_FILENO\n");
-                    close(dev_null_fd);
-                }
-                // Redirect stdout (file descriptor 1) to /dev/null
-                if (dup2(dev_null_fd, STDOUT_FILENO) == -1) {
-                    // perror("dup2 STDOUT_FILENO");
-                    syslog(LOG_ERR, "Failed dup2 STDOUT_FILENO\n");
-                    close(dev_null_fd);
-                }
-                // Redirect stderr (file descriptor 2) to /dev/null
-                if (dup2(dev_null_fd, STDERR_FILENO) == -1) {
-                    // perror("dup2 STDERR_FILENO");
-                    syslog(LOG_ERR, "Failed dup2 STDERR_FILENO\n");
-                    close(dev_null_fd);
-                }
 
+            //---Trying file init here in child daemon mode to see if it fixies file content issue between runs
+               
+            //Truncating file in case the last run had a kill signal and bypassed handling
+            if (store_init() != 0) {
+                return -1;
+            }
 
 
-                //---Trying file init here in child daemon mode to see if it fixies file content issue between runs
-                   
-                //Truncating file in case the last run had a kill signal and bypassed handling
-                FILE* fptr = fopen(TEMP_FILE, "w");
-                if (!fptr) {
-                    syslog(LOG_ERR, "Truncating file '%s' failed\n", TEMP_FILE);
-                    return -1;
-                }
-                fclose(fptr);
-
-
-
-                //TIMER HAS TO BE IN THE CHILD PROCESS (learned through a long time of debugging.....)
-                //---------------------------------------------------------------
-
-                if (USE_TIMESTAMP) {
-                        
-                    //Reference: https://github.com/cu-ecen-aeld/aesd-lectures/blob/master/lecture9/timer_thread.c
-                    memset(&td,0,sizeof(struct timer_thread_data));
-                    //Don't need to initialize mutex because we are using the one for the file
-                    //Setting up timer to be used for required timestamps in the output file
-                    int clock_id = CLOCK_MONOTONIC;
-                    memset(&sev, 0, sizeof(struct sigevent));
-                    //Setup call to timer_thread passing in td structure as the sigev_value arg
-                    sev.sigev_notify = SIGEV_THREAD;
-                    sev.sigev_notify_function = timer_thread;
-                    td.fileMutex = fileMutex;
-                    sev.sigev_value.sival_ptr = &td;
-
-                    if ( timer_create(clock_id,&sev,&timerid) != 0 ) {
-                        printf("Error %d (%s) creating timer!\n",errno,strerror(errno));
-                    } else {
-                        struct itimerspec sleep_time;
-                        
-                        sleep_time.it_value.tv_sec = 10;
-                        sleep_time.it_value.tv_nsec = 0;
-                        sleep_time.it_interval.tv_sec = 10;
-                        sleep_time.it_interval.tv_nsec = 0;
-
-                        //****************NEED TO ADD STUFF HERE*************
-                        //Reference: If statement below from asking Copilot AI "posix interval timer example"
-                            //Also had to change timespec sleep_time to itimerspec to work with POSIX timer
-                        if (timer_settime(timerid, 0, &sleep_time, NULL) == -1) {
-                            perror("Failed timer_settime()");
-                            //Error
-                            free(fileMutex);
-                            return -1;
-                        }
+
+            //TIMER HAS TO BE IN THE CHILD PROCESS (learned through a long time of debugging.....)
+            //---------------------------------------------------------------
+
+            if (USE_TIMESTAMP) {
+                    
+                //Reference: https://github.com/cu-ecen-aeld/aesd-lectures/blob/master/lecture9/timer_thread.c
+                memset(&td,0,sizeof(struct timer_thread_data));
+                //Don't need to initialize mutex because we are using the one for the file
+                //Setting up timer to be used for required timestamps in the output file
+                int clock_id = CLOCK_MONOTONIC;
+                memset(&sev, 0, sizeof(struct sigevent));
+                //Setup call to timer_thread passing in td structure as the sigev_value arg
+                sev.sigev_notify = SIGEV_THREAD;
+                sev.sigev_notify_function = timer_thread;
+                td.fileMutex = fileMutex;
+                sev.sigev_value.sival_ptr = &td;
+
+                if ( timer_create(clock_id,&sev,&timerid) != 0 ) {
+                    printf("Error %d (%s) creating timer!\n",errno,strerror(errno));
+                } else {
+                    struct itimerspec sleep_time;
+                    
+                    sleep_time.it_value.tv_sec = 10;
+                    sleep_time.it_value.tv_nsec = 0;
+                    sleep_time.it_interval.tv_sec = 10;
+                    sleep_time.it_interval.tv_nsec = 0;
+
+                    //****************NEED TO ADD STUFF HERE*************
+                    //Reference: If statement below from asking Copilot AI "posix interval timer example"
+                        //Also had to change timespec sleep_time to itimerspec to work with POSIX timer
+                    if (timer_settime(timerid, 0, &sleep_time, NULL) == -1) {
+                        perror("Failed timer_settime()");
+                        //Error
+                        free(fileMutex);
+                        return -1;
                     }
                 }
+            }
 
-                //---------------------------------------------------------------
+            //---------------------------------------------------------------
 
 
 
-                // Close the original file descriptor for /dev/null if it's not one of 0, 1, or 2
-                if (dev_null_fd > STDERR_FILENO) {
-                    close(dev_null_fd);
-                }
-                //-------------------
+            // Close the original file descriptor for /dev/null if it's not one of 0, 1, or 2
+            if (dev_null_fd > STDERR_FILENO) {
+                close(dev_null_fd);
             }
-            else { //Parent Process
+            //-------------------
+        }
+        else { //Parent Process
 
-                //Need to free all data that was associated with the parent process
+            //Need to free all data that was associated with the parent process
 
 
-                freeaddrinfo(servinfo);
-                free(fileMutex);
+            freeaddrinfo(servinfo);
+            free(fileMutex);
 
 
-                exit(EXIT_SUCCESS);
-            }
+            exit(EXIT_SUCCESS);
         }
-        else { //2 args but the second one is not '-d' case
-            syslog(LOG_ERR, "Invalid argument %s for %s\n", argv[1], argv[0]);
-        }
-    }
-    else if (argc > 2) {
-        syslog(LOG_ERR, "Invalid number of arguments for %s\n", argv[0]);
     } else { //Finished daemon code
 
 
         //Truncating file in case the last run had a kill signal and bypassed handling
-        FILE* fptr = fopen(TEMP_FILE, "w");
-        if (!fptr) {
-            syslog(LOG_ERR, "Truncating file '%s' failed\n", TEMP_FILE);
+        if (store_init() != 0) {
             return -1;
         }
-        fclose(fptr);
 
         if (USE_TIMESTAMP) {
             //Reference: https://github.com/cu-ecen-aeld/aesd-lectures/blob/master/lecture9/timer_thread.c
@@ -592,6 +1025,48 @@ int main(int argc, char *argv[]) {
 
 
 
+    //-------------------Durability Setup-----------------------------
+
+    //After the fork so the interval timer lives in the daemon child
+    clock_gettime(CLOCK_MONOTONIC, &durability.startTime);
+    timer_t syncTimerid;
+    bool syncTimerCreated = false;
+
+    durability.fileMutex = fileMutex;
+    if (USE_AESD_CHAR_DEVICE && durability.mode != DURABILITY_NONE) {
+        durability.syncfd = open(TEMP_FILE, O_RDONLY);
+        if (durability.syncfd == -1) {
+            perror("Failed to open file for fdatasync()");
+            syslog(LOG_ERR, "Failed to open %s for fdatasync()\n", TEMP_FILE);
+        }
+    }
+
+    if (durability.mode == DURABILITY_INTERVAL) {
+        struct sigevent syncSev;
+        memset(&syncSev, 0, sizeof(struct sigevent));
+        syncSev.sigev_notify = SIGEV_THREAD;
+        syncSev.sigev_notify_function = interval_sync_thread;
+
+        if (timer_create(CLOCK_MONOTONIC, &syncSev, &syncTimerid) != 0) {
+            printf("Error %d (%s) creating sync timer!\n",errno,strerror(errno));
+            syslog(LOG_ERR, "Failed timer_create() for interval sync\n");
+        } else {
+            syncTimerCreated = true;
+
+            struct itimerspec syncTime;
+            syncTime.it_value.tv_sec = durability.syncIntervalMs / 1000;
+            syncTime.it_value.tv_nsec = (durability.syncIntervalMs % 1000) * 1000000;
+            syncTime.it_interval = syncTime.it_value;
+
+            if (timer_settime(syncTimerid, 0, &syncTime, NULL) == -1) {
+                perror("Failed timer_settime() for interval sync");
+                syslog(LOG_ERR, "Failed timer_settime() for interval sync\n");
+            }
+        }
+    }
+
+    syslog(LOG_INFO, "Durability mode: %s\n", durability_mode_str(durability.mode));
+
     //Now listen for connections on the socket
     status = listen(sockfd, 10); 
     if (status == -1) {
@@ -625,11 +1100,17 @@ int main(int argc, char *argv[]) {
 
         int connfd = accept(sockfd, (struct sockaddr *)&client_addr, &addr_size);
         if (connfd == -1) {
+            free(pbuff);
+            free(outpbuff);
+
+            //SIGINT/SIGTERM interrupts accept(), fall through to the cleanup below
+            if (errno == EINTR && signalCaughtFlag) {
+                break;
+            }
+
             perror("Failed to accept\n");
             syslog(LOG_ERR, "Failed accept()\n");
             // freeaddrinfo(servinfo);
-            free(pbuff);
-            free(outpbuff);
             return -1;
         }
 
@@ -692,8 +1173,8 @@ int main(int argc, char *argv[]) {
             free(fileMutex);
             free(pbuff);
             free(outpbuff);
-            free(datap);
             free(datap->threadPtr);
+            free(datap);
             free(thread_func_args);
             free(memConnFd);
             return -1;
@@ -766,16 +1247,24 @@ int main(int argc, char *argv[]) {
         //Error
     }
 
+    if (syncTimerCreated && timer_delete(syncTimerid) != 0) {
+        perror("Error deleting sync timer");
+    }
+
+    //Whatever the mode, a clean shutdown leaves everything on disk
+    durability_sync();
+    if (durability.syncfd != -1) {
+        close(durability.syncfd);
+    }
+    durability_report();
+
     free(fileMutex);
     freeaddrinfo(servinfo);
 
 
     if (!USE_AESD_CHAR_DEVICE) {
-        //Deletes the specified file
-        if (remove(TEMP_FILE) != 0) {
-            perror("Was unable to delete the file");
-            syslog(LOG_ERR, "Was unable to delete the file %s\n", TEMP_FILE);
-        }
+        //Deletes the segments and the log directory, or checkpoints them for the next -r run
+        aesd_log_close(&storeLog, !warmRestart);
     }
 
     return 0; 